@@ -1,36 +1,52 @@
 #ifndef CNN_ALIGNED_MEM_POOL_H
 #define CNN_ALIGNED_MEM_POOL_H
 
+#include <algorithm>
 #include <iostream>
+#include <vector>
 #include "cnn/mem.h"
 
 namespace cnn {
 
 class AlignedMemoryPool {
  public:
-  explicit AlignedMemoryPool(size_t cap, MemAllocator* a) : a(a) {
+  // a growable pool takes another block, at least twice as large as the
+  // last one, when an allocation does not fit; the others abort. blocks are
+  // kept when the pool is freed, so a pool grows to its largest use once
+  explicit AlignedMemoryPool(size_t cap, MemAllocator* a, bool growable = false) :
+      current(0), growable(growable), a(a) {
     sys_alloc(cap);
-    zero_all();
+  }
+  AlignedMemoryPool(const AlignedMemoryPool&) = delete;
+  AlignedMemoryPool& operator=(const AlignedMemoryPool&) = delete;
+  ~AlignedMemoryPool() {
+    for (auto& b : blocks) a->free(b.mem);
   }
 
   void* allocate(size_t n) {
     auto rounded_n = a->round_up_align(n);
-    if (rounded_n + used > capacity) {
-      std::cerr << "cnn is out of memory, try increasing with --cnn-mem\n";
-      abort();
+    while (rounded_n + blocks[current].used > blocks[current].capacity) {
+      if (!growable) {
+        std::cerr << "cnn is out of memory, try increasing with --cnn-mem\n";
+        abort();
+      }
+      if (current + 1 == blocks.size())
+        sys_alloc(std::max(rounded_n, 2 * blocks.back().capacity));
+      ++current;
     }
-    void* res = static_cast<char*>(mem) + used;
-    used += rounded_n;
+    Block& b = blocks[current];
+    void* res = static_cast<char*>(b.mem) + b.used;
+    b.used += rounded_n;
     return res;
   }
   void free() {
-    //std::cerr << "freeing " << used << " bytes\n";
-    used = 0;
+    for (auto& b : blocks) b.used = 0;
+    current = 0;
   }
   // zeros out the amount of allocations
   void zero_allocated_memory() {
-    if (used == 0) return;
-    a->zero(mem, used);
+    for (size_t i = 0; i <= current; ++i)
+      if (blocks[i].used) a->zero(blocks[i].mem, blocks[i].used);
   }
 
   bool is_shared() {
@@ -38,20 +54,25 @@ class AlignedMemoryPool {
   }
  private:
   void sys_alloc(size_t cap) {
-    capacity = a->round_up_align(cap);
-    //std::cerr << "Allocating " << capacity << " ...\n";
-    mem = a->malloc(capacity);
-    if (!mem) { std::cerr << "Failed to allocate " << capacity << std::endl; abort(); }
-    used = 0;
-  }
-  void zero_all() {
-    a->zero(mem, capacity);
+    Block b;
+    b.capacity = a->round_up_align(cap);
+    //std::cerr << "Allocating " << b.capacity << " ...\n";
+    b.mem = a->malloc(b.capacity);
+    if (!b.mem) { std::cerr << "Failed to allocate " << b.capacity << std::endl; abort(); }
+    b.used = 0;
+    a->zero(b.mem, b.capacity);
+    blocks.push_back(b);
   }
-  size_t capacity;
-  size_t used;
+  struct Block {
+    void* mem;
+    size_t capacity;
+    size_t used;
+  };
+  std::vector<Block> blocks;
+  size_t current;  // block being allocated from
+  bool growable;
   bool shared;
   MemAllocator* a;
-  void* mem;
 };
 
 } // namespace cnn
@@ -13,7 +13,6 @@ namespace cnn {
 float* kSCALAR_MINUSONE;
 float* kSCALAR_ONE;
 float* kSCALAR_ZERO;
-int n_hgs = 0;
 
 Node::~Node() {}
 size_t Node::aux_storage_size() const { return 0; }
@@ -57,57 +56,72 @@ void Node::backward(const std::vector<const Tensor*>& xs,
 }
 
 ComputationGraph::ComputationGraph() :
-  ee(new SimpleExecutionEngine(*this)) {
-  ++n_hgs;
-  if (n_hgs > 1) {
-    cerr << "Memory allocator assumes only a single ComputationGraph at a time.\n";
-    throw std::runtime_error("Attempted to create >1 CG");
-  }
+  ee(new SimpleExecutionEngine(*this)),
+  checkpoint_nodes(0), checkpoint_parameter_nodes(0), checkpoint_mark(arena.mark()) {
 }
 
 ComputationGraph::~ComputationGraph() {
   this->clear();
   delete ee;
-  --n_hgs;
 }
 
 void ComputationGraph::clear() {
   parameter_nodes.clear();
-  for (auto n : nodes) delete n;
+  for (auto n : nodes) n->~Node();
   nodes.clear();
+  arena.reset();
+  checkpoint_nodes = 0;
+  checkpoint_parameter_nodes = 0;
+  checkpoint_mark = arena.mark();
+}
+
+void ComputationGraph::checkpoint() {
+  checkpoint_nodes = nodes.size();
+  checkpoint_parameter_nodes = parameter_nodes.size();
+  checkpoint_mark = arena.mark();
+}
+
+void ComputationGraph::revert() {
+  for (unsigned i = checkpoint_nodes; i < nodes.size(); ++i) nodes[i]->~Node();
+  nodes.resize(checkpoint_nodes);
+  parameter_nodes.resize(checkpoint_parameter_nodes);
+  arena.rewind(checkpoint_mark);
+  // the values of the kept nodes are recomputed too, which for parameters
+  // only means pointing at them again
+  ee->invalidate();
 }
 
 VariableIndex ComputationGraph::add_input(real s) {
   VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new ScalarInputNode(s));
+  nodes.push_back(make_node<ScalarInputNode>(s));
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_input(const real* ps) {
   VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new ScalarInputNode(ps));
+  nodes.push_back(make_node<ScalarInputNode>(ps));
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_input(const Dim& d, const vector<float>& pm) {
   VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new InputNode(d, pm));
+  nodes.push_back(make_node<InputNode>(d, pm));
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_input(const Dim& d, const vector<float>* pm) {
   VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new InputNode(d, pm));
+  nodes.push_back(make_node<InputNode>(d, pm));
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_parameters(Parameters* p) {
   VariableIndex new_node_index(nodes.size());
-  ParameterNode* new_node = new ParameterNode(p);
+  ParameterNode* new_node = make_node<ParameterNode>(p);
   nodes.push_back(new_node);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
@@ -116,7 +130,7 @@ VariableIndex ComputationGraph::add_parameters(Parameters* p) {
 
 VariableIndex ComputationGraph::add_const_parameters(Parameters* p) {
   VariableIndex new_node_index(nodes.size());
-  ConstParameterNode* new_node = new ConstParameterNode(p);
+  ConstParameterNode* new_node = make_node<ConstParameterNode>(p);
   nodes.push_back(new_node);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
@@ -124,7 +138,7 @@ VariableIndex ComputationGraph::add_const_parameters(Parameters* p) {
 
 VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const unsigned* pindex) {
   VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, pindex);
+  LookupNode* new_node = make_node<LookupNode>(p, pindex);
   nodes.push_back(new_node);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
@@ -133,7 +147,7 @@ VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const unsigned*
 
 VariableIndex ComputationGraph::add_lookup(LookupParameters* p, unsigned index) {
   VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, index);
+  LookupNode* new_node = make_node<LookupNode>(p, index);
   nodes.push_back(new_node);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
@@ -142,7 +156,7 @@ VariableIndex ComputationGraph::add_lookup(LookupParameters* p, unsigned index)
 
 VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const std::vector<unsigned>& indices) {
   VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, indices);
+  LookupNode* new_node = make_node<LookupNode>(p, indices);
   nodes.push_back(new_node);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
@@ -151,7 +165,7 @@ VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const std::vecto
 
 VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const std::vector<unsigned>* indices) {
   VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, indices);
+  LookupNode* new_node = make_node<LookupNode>(p, indices);
   nodes.push_back(new_node);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
@@ -161,7 +175,7 @@ VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const std::vecto
 
 VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, const unsigned* pindex) {
   VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, pindex);
+  LookupNode* new_node = make_node<LookupNode>(p, pindex);
   // get rid of the following in favor of using parameter_nodes to see the needs_derivative
   // expression
   nodes.push_back(new_node);
@@ -171,7 +185,7 @@ VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, const unsi
 
 VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, unsigned index) {
   VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, index);
+  LookupNode* new_node = make_node<LookupNode>(p, index);
   nodes.push_back(new_node);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
@@ -179,7 +193,7 @@ VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, unsigned i
 
 VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, const std::vector<unsigned>& indices) {
   VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, indices);
+  LookupNode* new_node = make_node<LookupNode>(p, indices);
   nodes.push_back(new_node);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
@@ -187,32 +201,61 @@ VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, const std:
 
 VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, const std::vector<unsigned>* indices) {
   VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, indices);
+  LookupNode* new_node = make_node<LookupNode>(p, indices);
   nodes.push_back(new_node);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
+static inline size_t hash_dim(size_t h, const Dim& d) {
+  auto mix = [&h](size_t v) { h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2); };
+  mix(d.nd);
+  for (unsigned i = 0; i < d.nd; ++i) mix(d.d[i]);
+  mix(d.bd);
+  return h;
+}
+
 // factory function should call this right after creating a new node object
 // to set its dimensions properly
 void ComputationGraph::set_dim_for_new_node(const VariableIndex& i) {
   Node* node = nodes[i];
-  vector<Dim> xds(node->arity());
+  xds.resize(node->arity());
   unsigned ai = 0;
   for (VariableIndex arg : node->args) {
     xds[ai] = nodes[arg]->dim;
     ++ai;
   }
+  if (!node->dim_is_cacheable()) {
+    node->dim = node->dim_forward(xds);
+    return;
+  }
+  const type_info& type = typeid(*node);
+  size_t h = type.hash_code();
+  for (const Dim& d : xds) h = hash_dim(h, d);
+  auto range = dim_cache.equal_range(h);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (*it->second.type == type && it->second.xs == xds) {
+      node->dim = it->second.d;
+      return;
+    }
+  }
+  // not cached if dim_forward throws
   node->dim = node->dim_forward(xds);
+  dim_cache.insert({h, {&type, xds, node->dim}});
 }
 
 const Tensor& ComputationGraph::incremental_forward() { return ee->incremental_forward(); }
+const Tensor& ComputationGraph::incremental_forward(VariableIndex i) { return ee->incremental_forward(i); }
+const Tensor& ComputationGraph::incremental_forward(const expr::Expression& e) { return this->incremental_forward(e.i); }
 const Tensor& ComputationGraph::forward() { return ee->forward(); }
 const Tensor& ComputationGraph::get_value(VariableIndex i) { return ee->get_value(i); }
 const Tensor& ComputationGraph::get_value(const expr::Expression& e) { return this->get_value(e.i); }
 void ComputationGraph::invalidate() { ee->invalidate(); }
 void ComputationGraph::backward() { ee->backward(); }
 void ComputationGraph::backward(VariableIndex i) { ee->backward(i); }
+void ComputationGraph::compute_gradients() { ee->compute_gradients(VariableIndex(nodes.size() - 1)); }
+void ComputationGraph::compute_gradients(VariableIndex i) { ee->compute_gradients(i); }
+const Tensor& ComputationGraph::get_gradient(VariableIndex i) const { return ee->get_gradient(i); }
 
 void ComputationGraph::PrintGraphviz() const {
   cerr << "digraph G {\n  rankdir=LR;\n  nodesep=.05;\n";
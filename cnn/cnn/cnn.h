@@ -5,7 +5,12 @@
 #include <vector>
 #include <iostream>
 #include <initializer_list>
+#include <iterator>
+#include <algorithm>
+#include <new>
 #include <utility>
+#include <typeinfo>
+#include <unordered_map>
 #include <boost/serialization/strong_typedef.hpp>
 
 #include "cnn/init.h"
@@ -13,6 +18,7 @@
 #include "cnn/tensor.h"
 #include "cnn/model.h"
 #include "cnn/devices.h"
+#include "cnn/node-arena.h"
 
 // Computation graph where nodes represent forward and backward intermediate
 // values, and edges represent functions of multiple values. To represent the
@@ -25,8 +31,6 @@
 
 namespace cnn {
 
-extern AlignedMemoryPool* fxs;
-extern AlignedMemoryPool* dEdfs;
 extern AlignedMemoryPool* ps;
 extern float* kSCALAR_MINUSONE;
 extern float* kSCALAR_ONE;
@@ -87,10 +91,18 @@ struct ComputationGraph {
   template <class Function, typename... Args>
   inline VariableIndex add_function(const std::initializer_list<VariableIndex>& arguments,
                                     Args&&... side_information);
-  template <class Function, typename T> inline VariableIndex add_function(const T& arguments);
+  template <class Function, typename T, typename... Args>
+  inline VariableIndex add_function(const T& arguments, Args&&... side_information);
 
   // reset ComputationGraph to a newly created state
   void clear();
+  // marks the nodes added so far (usually the parameters that every sentence
+  // uses) as a prefix that revert() returns to, so that a graph that is built
+  // again and again only rebuilds the nodes after it
+  void checkpoint();
+  // removes the nodes added since the last checkpoint() and forgets all the
+  // computed values
+  void revert();
 
   // perform computations
 
@@ -99,6 +111,10 @@ struct ComputationGraph {
   // run forward pass from the last computed node to last existing.
   // useful if you want to add nodes and evaluate just the new parts.
   const Tensor& incremental_forward();
+  // the same, but only up to node i, so that nodes added after it (such as
+  // the loss terms of a decoder) are left for a later call
+  const Tensor& incremental_forward(VariableIndex i);
+  const Tensor& incremental_forward(const expr::Expression& e);
   // get forward value for node at index i. used cached values if available,
   // performs forward evaluation if note available (may compute more than strictly
   // what is needed).
@@ -110,6 +126,13 @@ struct ComputationGraph {
   void backward();
   // computes backward gradients from node i (assuming it already been evaluated).
   void backward(VariableIndex i);
+  // like backward, but the gradients are not added to the parameters; read
+  // them with get_gradient (e.g., for the nodes in parameter_nodes). this
+  // lets several threads compute gradients for the same model at once.
+  void compute_gradients();
+  void compute_gradients(VariableIndex i);
+  // gradient of node i from the last compute_gradients or backward call
+  const Tensor& get_gradient(VariableIndex i) const;
 
   // debugging
   void PrintGraphviz() const;
@@ -121,6 +144,54 @@ struct ComputationGraph {
   ExecutionEngine* ee;  // handles the execution
  private:
   void set_dim_for_new_node(const VariableIndex& i);
+  // nodes live in the arena, which clear() resets after destroying them
+  template <class T, typename... Args> T* make_node(Args&&... args) {
+    return new (arena.allocate(sizeof(T))) T(std::forward<Args>(args)...);
+  }
+  NodeArena arena;
+  // what revert() keeps
+  unsigned checkpoint_nodes;
+  unsigned checkpoint_parameter_nodes;
+  NodeArena::Mark checkpoint_mark;
+  // dimensions computed for nodes whose dim_forward only depends on the
+  // dimensions of their arguments, hashed by node type and argument
+  // dimensions. unlike the nodes, they are kept by clear()
+  struct DimCacheEntry {
+    const std::type_info* type;
+    std::vector<Dim> xs;
+    Dim d;
+  };
+  std::unordered_multimap<size_t, DimCacheEntry> dim_cache;
+  std::vector<Dim> xds;  // argument dimensions of the node being added
+};
+
+// the indices of the arguments of a node. lists of up to kInline indices,
+// which covers nearly every node (an LSTMCell has at most 16 arguments), are
+// stored in the node itself, so building a node does not allocate
+class NodeArgs {
+ public:
+  static constexpr unsigned kInline = 16;
+  NodeArgs() : n(0), data(inline_args) {}
+  NodeArgs(const std::initializer_list<VariableIndex>& a) : NodeArgs(a.begin(), a.end()) {}
+  template <typename It>
+  NodeArgs(It first, It last) : n(std::distance(first, last)),
+                                data(n <= kInline ? inline_args : new VariableIndex[n]) {
+    std::copy(first, last, data);
+  }
+  NodeArgs(const NodeArgs&) = delete;
+  NodeArgs& operator=(const NodeArgs&) = delete;
+  ~NodeArgs() {
+    if (data != inline_args) delete[] data;
+  }
+  unsigned size() const { return n; }
+  bool empty() const { return n == 0; }
+  const VariableIndex* begin() const { return data; }
+  const VariableIndex* end() const { return data + n; }
+  const VariableIndex& operator[](unsigned i) const { return data[i]; }
+ private:
+  unsigned n;
+  VariableIndex* data;
+  VariableIndex inline_args[kInline];
 };
 
 // represents an SSA variable
@@ -154,12 +225,23 @@ struct Node {
                              const Tensor& dEdf,
                              unsigned i,
                              Tensor& dEdxi) const = 0;
+  // called once per backward pass, before backward for any of the arguments,
+  // so that a node can compute what the gradients of all of them share
+  virtual void backward_begin(const std::vector<const Tensor*>& xs,
+                              const Tensor& fx,
+                              const Tensor& dEdf) const {}
 
   // whether this node supports computing multiple batches in one call.
   // if true, forward and backward will be called once with a multi-batch tensor.
   // if false, forward and backward will be called multiple times for each item.
   virtual bool supports_multibatch() const { return false; }
 
+  // whether dim_forward depends on nothing but the dimensions of the
+  // arguments, so the graph may reuse the result for another node of the
+  // same type with the same argument dimensions. it pays off for nodes that
+  // check their arguments, such as AffineTransform
+  virtual bool dim_is_cacheable() const { return false; }
+
   // perform the forward/backward passes in one or multiple calls
   virtual void forward(const std::vector<const Tensor*>& xs,
                        Tensor& fx) const final;
@@ -173,7 +255,7 @@ struct Node {
   inline unsigned arity() const { return args.size(); }
 
   // dependency structure
-  std::vector<VariableIndex> args;
+  NodeArgs args;
 
   // memory size
   Dim dim;  // will be .size() = 0 initially filled in by forward() -- TODO fix this
@@ -196,7 +278,7 @@ struct Node {
 template <class Function>
 inline VariableIndex ComputationGraph::add_function(const std::initializer_list<VariableIndex>& arguments) {
   VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new Function(arguments));
+  nodes.push_back(make_node<Function>(arguments));
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
@@ -206,15 +288,16 @@ template <class Function, typename... Args>
 inline VariableIndex ComputationGraph::add_function(const std::initializer_list<VariableIndex>& arguments,
                                               Args&&... side_information) {
   VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new Function(arguments, std::forward<Args>(side_information)...));
+  nodes.push_back(make_node<Function>(arguments, std::forward<Args>(side_information)...));
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
-template <class Function, typename T>
-inline VariableIndex ComputationGraph::add_function(const T& arguments) {
+template <class Function, typename T, typename... Args>
+inline VariableIndex ComputationGraph::add_function(const T& arguments,
+                                              Args&&... side_information) {
   VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new Function(arguments));
+  nodes.push_back(make_node<Function>(arguments, std::forward<Args>(side_information)...));
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
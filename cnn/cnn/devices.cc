@@ -1,5 +1,6 @@
 #include "cnn/devices.h"
 
+#include <algorithm>
 #include <iostream>
 
 #include "cnn/cuda.h"
@@ -8,8 +9,37 @@ using namespace std;
 
 namespace cnn {
 
+const size_t Device::kDefaultGraphPoolBytes;
+
 Device::~Device() {}
 
+GraphPools Device::acquire_graph_pools() {
+  {
+    std::lock_guard<std::mutex> lock(graph_pools_mutex);
+    if (free_graph_pools.size()) {
+      GraphPools pools = free_graph_pools.back();
+      free_graph_pools.pop_back();
+      return pools;
+    }
+  }
+  return GraphPools{new AlignedMemoryPool(graph_pool_bytes, mem, true),
+                    new AlignedMemoryPool(graph_pool_bytes, mem, true)};
+}
+
+void Device::release_graph_pools(const GraphPools& pools) {
+  std::lock_guard<std::mutex> lock(graph_pools_mutex);
+  free_graph_pools.push_back(pools);
+}
+
+void Device::clear_graph_pools() {
+  std::lock_guard<std::mutex> lock(graph_pools_mutex);
+  for (auto& pools : free_graph_pools) {
+    delete pools.fxs;
+    delete pools.dEdfs;
+  }
+  free_graph_pools.clear();
+}
+
 #if HAVE_CUDA
 Device_GPU::Device_GPU(int mb, int device_id) :
     Device(DeviceType::GPU, &gpu_mem), cuda_device_id(device_id), gpu_mem(device_id) {
@@ -32,6 +62,8 @@ Device_GPU::Device_GPU(int mb, int device_id) :
   fxs = new AlignedMemoryPool(byte_count, mem); // memory for node values
   dEdfs = new AlignedMemoryPool(byte_count, mem); // memory for node gradients
   ps = new AlignedMemoryPool(byte_count, mem); // memory for parameters
+  graph_pool_bytes = std::min(byte_count, kDefaultGraphPoolBytes);
+  release_graph_pools(GraphPools{fxs, dEdfs});
 
 }
 
@@ -59,6 +91,8 @@ Device_CPU::Device_CPU(int mb, bool shared) :
   fxs = new AlignedMemoryPool(byte_count, mem); // memory for node values
   dEdfs = new AlignedMemoryPool(byte_count, mem); // memory for node gradients
   ps = new AlignedMemoryPool(byte_count, mem); // memory for parameters
+  graph_pool_bytes = std::min(byte_count, kDefaultGraphPoolBytes);
+  release_graph_pools(GraphPools{fxs, dEdfs});
 
 }
 
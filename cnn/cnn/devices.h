@@ -2,6 +2,8 @@
 #define CNN_DEVICES_H
 
 #include <string>
+#include <vector>
+#include <mutex>
 #include "cnn/aligned-mem-pool.h"
 #include "cnn/cuda.h"
 
@@ -9,9 +11,15 @@ namespace cnn {
 
 enum class DeviceType {CPU, GPU};
 
+// node value and gradient memory for one ComputationGraph
+struct GraphPools {
+  AlignedMemoryPool* fxs;
+  AlignedMemoryPool* dEdfs;
+};
+
 class Device {
  protected:
-  Device(DeviceType t, MemAllocator* m) : type(t), mem(m) {}
+  Device(DeviceType t, MemAllocator* m) : type(t), mem(m), graph_pool_bytes(0) {}
   Device(const Device&) = delete;
   Device& operator=(const Device&) = delete;
   virtual ~Device();
@@ -25,6 +33,23 @@ class Device {
   float* kSCALAR_ONE;
   float* kSCALAR_ZERO;
   std::string name;
+
+  // each execution engine takes a pair of pools when it is created and
+  // gives it back when it is destroyed, so graphs can be alive at the same
+  // time (e.g., one per thread). returned pools are reused; new ones of
+  // graph_pool_bytes are allocated when none is free. fxs and dEdfs above
+  // are the first pair. the pools allocated here grow when a graph does not
+  // fit, so graph_pool_bytes is only their initial size: each thread costs
+  // as much memory as its largest graph rather than another --cnn-mem.
+  GraphPools acquire_graph_pools();
+  void release_graph_pools(const GraphPools& pools);
+  // deletes the pools that are not in use
+  void clear_graph_pools();
+  size_t graph_pool_bytes;
+  static const size_t kDefaultGraphPoolBytes = 16 << 20;
+ private:
+  std::vector<GraphPools> free_graph_pools;
+  std::mutex graph_pools_mutex;
 };
 
 #if HAVE_CUDA
@@ -8,6 +8,13 @@ namespace cnn {
 
 ExecutionEngine::~ExecutionEngine() {}
 
+SimpleExecutionEngine::SimpleExecutionEngine(const ComputationGraph& cg) :
+    ExecutionEngine(cg), num_nodes_evaluated(0), pools(default_device->acquire_graph_pools()) {}
+
+SimpleExecutionEngine::~SimpleExecutionEngine() {
+  default_device->release_graph_pools(pools);
+}
+
 void SimpleExecutionEngine::invalidate() {
   num_nodes_evaluated = 0;
 }
@@ -39,7 +46,7 @@ const Tensor& SimpleExecutionEngine::incremental_forward(VariableIndex i) {
   assert(i < cg.nodes.size());
 
   // free any old memory if this is a new CG
-  if (num_nodes_evaluated == 0) fxs->free();
+  if (num_nodes_evaluated == 0) pools.fxs->free();
 
   if (i >= num_nodes_evaluated) {
     nfxs.resize(i + 1);
@@ -55,7 +62,7 @@ const Tensor& SimpleExecutionEngine::incremental_forward(VariableIndex i) {
         ++ai;
       }
       nfxs[num_nodes_evaluated].d = node->dim;
-      nfxs[num_nodes_evaluated].v = static_cast<float*>(fxs->allocate(node->dim.size() * sizeof(float)));
+      nfxs[num_nodes_evaluated].v = static_cast<float*>(pools.fxs->allocate(node->dim.size() * sizeof(float)));
       if (nfxs[num_nodes_evaluated].v == nullptr) {
         cerr << "out of memory\n";
         abort();
@@ -63,7 +70,7 @@ const Tensor& SimpleExecutionEngine::incremental_forward(VariableIndex i) {
       void* aux_mem = nullptr;
       size_t aux_size = node->aux_storage_size();
       if (aux_size) {
-        aux_mem = fxs->allocate(aux_size);
+        aux_mem = pools.fxs->allocate(aux_size);
         if (!aux_mem) {
           cerr << "aux out of memory\n";
           abort();
@@ -83,6 +90,22 @@ void SimpleExecutionEngine::backward() {
 
 // TODO what is happening with parameter nodes if from_where > param_node_id ?
 void SimpleExecutionEngine::backward(VariableIndex from_where) {
+  compute_gradients(from_where);
+
+  // accumulate gradients into parameters
+  // this is simpler than you might find in some other frameworks
+  // since we assume parameters come into the graph as a "function"
+  // that returns the current value of the parameters
+  for (VariableIndex i : cg.parameter_nodes)
+    static_cast<ParameterNodeBase*>(cg.nodes[i])->accumulate_grad(ndEdfs[i]);
+}
+
+const Tensor& SimpleExecutionEngine::get_gradient(VariableIndex i) const {
+  assert(i < ndEdfs.size());
+  return ndEdfs[i];
+}
+
+void SimpleExecutionEngine::compute_gradients(VariableIndex from_where) {
   assert(from_where+1 <= nfxs.size());
   assert(from_where+1 <= cg.nodes.size());
   if (nfxs[from_where].d.size() != 1) {
@@ -92,17 +115,17 @@ void SimpleExecutionEngine::backward(VariableIndex from_where) {
 
   const unsigned num_nodes = from_where+1;
   ndEdfs.resize(num_nodes);
-  dEdfs->free();
+  pools.dEdfs->free();
   for (unsigned i = 0; i < num_nodes; ++i) {
     const auto dim = nfxs[i].d;
     ndEdfs[i].d = dim;
-    ndEdfs[i].v = static_cast<float*>(dEdfs->allocate(dim.size() * sizeof(float)));
+    ndEdfs[i].v = static_cast<float*>(pools.dEdfs->allocate(dim.size() * sizeof(float)));
     if (!ndEdfs[i].v) {
       cerr << "out of memory while attempting to allocate space for derivatives\n";
       abort();
     }
   }
-  dEdfs->zero_allocated_memory();
+  pools.dEdfs->zero_allocated_memory();
   // initialize dE/dE = 1
   ndEdfs.back().v = kSCALAR_ONE;
 
@@ -138,21 +161,19 @@ void SimpleExecutionEngine::backward(VariableIndex from_where) {
       xs[ai] = &nfxs[arg];
       ++ai;
     }
+    bool begun = false;
     ai = 0;
     for (VariableIndex arg : node->args) {
       if (needs_derivative[arg]) {
+        if (!begun) {
+          node->backward_begin(xs, nfxs[i], ndEdfs[i]);
+          begun = true;
+        }
         node->backward(xs, nfxs[i], ndEdfs[i], ai, ndEdfs[arg]);
       }
       ++ai;
     }
   }
-
-  // accumulate gradients into parameters
-  // this is simpler than you might find in some other frameworks
-  // since we assume parameters come into the graph as a "function"
-  // that returns the current value of the parameters
-  for (VariableIndex i : cg.parameter_nodes)
-    static_cast<ParameterNodeBase*>(cg.nodes[i])->accumulate_grad(ndEdfs[i]);
 }
 
 } // namespace cnn
@@ -16,6 +16,8 @@ class ExecutionEngine {
   virtual const Tensor& get_value(VariableIndex i) = 0;
   virtual void backward() = 0;
   virtual void backward(VariableIndex i) = 0;
+  virtual void compute_gradients(VariableIndex i) = 0;
+  virtual const Tensor& get_gradient(VariableIndex i) const = 0;
  protected:
   explicit ExecutionEngine(const ComputationGraph& cg) : cg(cg) {}
   const ComputationGraph& cg;
@@ -23,7 +25,8 @@ class ExecutionEngine {
 
 class SimpleExecutionEngine : public ExecutionEngine {
  public:
-  explicit SimpleExecutionEngine(const ComputationGraph& cg) : ExecutionEngine(cg) {}
+  explicit SimpleExecutionEngine(const ComputationGraph& cg);
+  ~SimpleExecutionEngine();
   void invalidate() override;
   const Tensor& forward() override;
   const Tensor& forward(VariableIndex i) override;
@@ -32,10 +35,13 @@ class SimpleExecutionEngine : public ExecutionEngine {
   const Tensor& get_value(VariableIndex i) override;
   void backward() override;
   void backward(VariableIndex i) override;
+  void compute_gradients(VariableIndex i) override;
+  const Tensor& get_gradient(VariableIndex i) const override;
  private:
   std::vector<Tensor> nfxs;
   std::vector<Tensor> ndEdfs;
   VariableIndex num_nodes_evaluated;
+  GraphPools pools;  // taken from the default device for the engine's lifetime
 };
 
 } // namespace cnn
@@ -59,6 +59,7 @@ Expression hinge(const Expression& x, unsigned index, float m) { return Expressi
 Expression hinge(const Expression& x, const unsigned* pindex, float m) { return Expression(x.pg, x.pg->add_function<Hinge>({x.i}, pindex, m)); }
 Expression log_softmax(const Expression& x) { return Expression(x.pg, x.pg->add_function<LogSoftmax>({x.i})); }
 Expression log_softmax(const Expression& x, const vector<unsigned>& d) { return Expression(x.pg, x.pg->add_function<RestrictedLogSoftmax>({x.i}, d)); }
+Expression masked_argmax(const Expression& x, const vector<unsigned>& mask) { return Expression(x.pg, x.pg->add_function<MaskedArgmax>({x.i}, mask)); }
 Expression sparsemax(const Expression& x) { return Expression(x.pg, x.pg->add_function<Sparsemax>({x.i})); }
 Expression sparsemax_loss(const Expression& x, const vector<unsigned>& target_support) { return Expression(x.pg, x.pg->add_function<SparsemaxLoss>({x.i}, target_support)); }
 Expression sparsemax_loss(const Expression& x, const vector<unsigned>* ptarget_support) { return Expression(x.pg, x.pg->add_function<SparsemaxLoss>({x.i}, ptarget_support)); }
@@ -114,7 +115,14 @@ Expression pickneglogsoftmax(const Expression& x, const vector<unsigned> * pv) {
 Expression sum_cols(const Expression& x) { return Expression(x.pg, x.pg->add_function<SumColumns>({x.i})); }
 
 Expression sum_batches(const Expression& x) { return Expression(x.pg, x.pg->add_function<SumBatches>({x.i})); }
+Expression pick_batch_elem(const Expression& x, unsigned b) { return Expression(x.pg, x.pg->add_function<PickBatchElement>({x.i}, b)); }
 
 Expression kmh_ngram(const Expression& x, unsigned n) { return Expression(x.pg, x.pg->add_function<KMHNGram>({x.i}, n)); }
 
+Expression lstm_cell(const vector<Expression>& xs, unsigned t) {
+  vector<VariableIndex> xis(xs.size());
+  for (unsigned i = 0; i < xs.size(); ++i) xis[i] = xs[i].i;
+  return Expression(xs[0].pg, xs[0].pg->add_function<LSTMCell>(xis, int(t)));
+}
+
 } }
@@ -75,6 +75,9 @@ Expression hinge(const Expression& x, unsigned index, float m = 1.0);
 Expression hinge(const Expression& x, const unsigned* pindex, float m = 1.0);
 Expression log_softmax(const Expression& x);
 Expression log_softmax(const Expression& x, const std::vector<unsigned>& restriction);
+// [index, score] of the largest element of x among the indices in mask, so
+// that a decoder can read its decision without copying the whole vector
+Expression masked_argmax(const Expression& x, const std::vector<unsigned>& mask);
 Expression sparsemax(const Expression& x);
 Expression sparsemax_loss(const Expression& x, const std::vector<unsigned>& target_support);
 Expression sparsemax_loss(const Expression& x, const std::vector<unsigned>* ptarget_support);
@@ -123,6 +126,8 @@ Expression kmh_ngram(const Expression& x, unsigned n);
 
 // Sum the results of multiple batches
 Expression sum_batches(const Expression& x);
+// Select a single element of a multi-batch expression
+Expression pick_batch_elem(const Expression& x, unsigned b);
 
 // pick parts out of bigger objects
 Expression pick(const Expression& x, unsigned v);
@@ -170,10 +175,24 @@ template <typename T>
 inline Expression concatenate(const T& xs) { return detail::f<Concatenate>(xs); }
 inline Expression concatenate(const std::initializer_list<Expression>& xs) { return detail::f<Concatenate>(xs); }
 
+template <typename T>
+inline Expression concatenate_to_batch(const T& xs) { return detail::f<ConcatenateToBatch>(xs); }
+inline Expression concatenate_to_batch(const std::initializer_list<Expression>& xs) { return detail::f<ConcatenateToBatch>(xs); }
+
 template <typename T>
 inline Expression affine_transform(const T& xs) { return detail::f<AffineTransform>(xs); }
 inline Expression affine_transform(const std::initializer_list<Expression>& xs) { return detail::f<AffineTransform>(xs); }
 
+// xs = the 11 LSTMBuilder parameters of a layer, then x_t and, optionally,
+// h_{t-1} and c_{t-1}; the result is [h_t; c_t]
+template <typename T>
+inline Expression lstm_cell(const T& xs) { return detail::f<LSTMCell>(xs); }
+inline Expression lstm_cell(const std::initializer_list<Expression>& xs) { return detail::f<LSTMCell>(xs); }
+// as above, but x_t is replaced by the three gate input projections
+// W_xi x + b_i, W_xc x + b_c and W_xo x + b_o of a whole sequence, with one
+// batch element per timestep, and the cell computes timestep t
+Expression lstm_cell(const std::vector<Expression>& xs, unsigned t);
+
 } }
 
 #endif
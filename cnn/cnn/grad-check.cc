@@ -57,7 +57,7 @@ bool CheckGrad(Model& m, ComputationGraph& g, int verbosity) {
       cerr << endl << "LOOKUP PARAMETERS " << pp << endl;
     LookupParameters& p = *pp;
     size_t ts = p.dim.size();
-    for (unsigned j : p.non_zero_grads) {
+    for (unsigned j : p.touched_rows()) {
       if(verbosity > 1)
         cerr << "OBJECT=" << j << endl;
       Tensor& v = p.values[j];
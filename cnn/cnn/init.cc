@@ -16,8 +16,6 @@ using namespace std;
 namespace cnn {
 
 // these should maybe live in a file called globals.cc or something
-AlignedMemoryPool* fxs = nullptr;
-AlignedMemoryPool* dEdfs = nullptr;
 AlignedMemoryPool* ps = nullptr;
 mt19937* rndeng = nullptr;
 std::vector<Device*> devices;
@@ -37,6 +35,7 @@ void Initialize(int& argc, char**& argv, unsigned random_seed, bool shared_param
   gpudevices = Initialize_GPU(argc, argv);
 #endif
   unsigned long num_mb = 512UL;
+  unsigned long graph_mb = 0;
   int argi = 1;
   while(argi < argc) {
     string arg = argv[argi];
@@ -49,6 +48,15 @@ void Initialize(int& argc, char**& argv, unsigned random_seed, bool shared_param
         istringstream c(a2); c >> num_mb;
         RemoveArgs(argc, argv, argi, 2);
       }
+    } else if (arg == "--cnn-graph-mem" || arg == "--cnn_graph_mem") {
+      if ((argi + 1) > argc) {
+        cerr << "[cnn] --cnn-graph-mem expects an argument (the initial memory, in megabytes, for each additional concurrent graph)\n";
+        abort();
+      } else {
+        string a2 = argv[argi+1];
+        istringstream c(a2); c >> graph_mb;
+        RemoveArgs(argc, argv, argi, 2);
+      }
     } else if (arg == "--cnn-seed" || arg == "--cnn_seed") {
       if ((argi + 1) > argc) {
         cerr << "[cnn] --cnn-seed expects an argument (the random number seed)\n";
@@ -79,10 +87,9 @@ void Initialize(int& argc, char**& argv, unsigned random_seed, bool shared_param
     default_index++;
   }
   default_device = devices[default_index];
+  if (graph_mb) default_device->graph_pool_bytes = graph_mb << 20;
 
   // TODO these should be accessed through the relevant device and removed here
-  fxs = default_device->fxs;
-  dEdfs = default_device->dEdfs;
   ps = default_device->ps;
   kSCALAR_MINUSONE = default_device->kSCALAR_MINUSONE;
   kSCALAR_ONE = default_device->kSCALAR_ONE;
@@ -92,8 +99,7 @@ void Initialize(int& argc, char**& argv, unsigned random_seed, bool shared_param
 
 void Cleanup() {
   delete rndeng;
-  delete fxs;
-  delete dEdfs;
+  default_device->clear_graph_pools();
   delete ps;
 }
 
@@ -4,6 +4,8 @@
 #include <cassert>
 #include <vector>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 
 #include "cnn/nodes.h"
 
@@ -112,44 +114,212 @@ Expression LSTMBuilder::add_input_impl(int prev, const Expression& x) {
     }
     // apply dropout according to http://arxiv.org/pdf/1409.2329v5.pdf
     if (dropout_rate) in = dropout(in, dropout_rate);
-    // input
-    Expression i_ait;
-    if (has_prev_state)
-      i_ait = affine_transform({vars[BI], vars[X2I], in, vars[H2I], i_h_tm1, vars[C2I], i_c_tm1});
-    else
-      i_ait = affine_transform({vars[BI], vars[X2I], in});
-    Expression i_it = logistic(i_ait);
-    // forget
-    Expression i_ft = 1.f - i_it;
-    // write memory cell
-    Expression i_awt;
-    if (has_prev_state)
-      i_awt = affine_transform({vars[BC], vars[X2C], in, vars[H2C], i_h_tm1});
-    else
-      i_awt = affine_transform({vars[BC], vars[X2C], in});
-    Expression i_wt = tanh(i_awt);
-    // output
+    vector<Expression> args = vars;
+    args.push_back(in);
     if (has_prev_state) {
-      Expression i_nwt = cwise_multiply(i_it,i_wt);
-      Expression i_crt = cwise_multiply(i_ft,i_c_tm1);
-      ct[i] = i_crt + i_nwt;
-    } else {
-      ct[i] = cwise_multiply(i_it,i_wt);
+      args.push_back(i_h_tm1);
+      args.push_back(i_c_tm1);
     }
-
-    Expression i_aot;
-    if (has_prev_state)
-      i_aot = affine_transform({vars[BO], vars[X2O], in, vars[H2O], i_h_tm1, vars[C2O], ct[i]});
-    else
-      i_aot = affine_transform({vars[BO], vars[X2O], in, vars[C2O], ct[i]});
-    Expression i_ot = logistic(i_aot);
-    Expression ph_t = tanh(ct[i]);
-    in = ht[i] = cwise_multiply(i_ot,ph_t);
+    const unsigned hidden_dim = params[i][BI]->dim.rows();
+    Expression i_hct = lstm_cell(args);
+    ct[i] = pickrange(i_hct, hidden_dim, 2 * hidden_dim);
+    in = ht[i] = pickrange(i_hct, 0, hidden_dim);
   }
   if (dropout_rate) return dropout(ht.back(), dropout_rate);
     else return ht.back();
 }
 
+// same cell as add_input_impl, but the K steps are stacked along the
+// batch dimension so that each gate product is a single GEMM
+void LSTMBuilder::add_input_batch_impl(const vector<RNNPointer>& prev,
+                                       const vector<Expression>& xs) {
+  const unsigned K = xs.size();
+  if (K == 1) {
+    add_input_impl(prev[0], xs[0]);
+    return;
+  }
+  const unsigned first = h.size();
+  for (unsigned k = 0; k < K; ++k) {
+    h.push_back(vector<Expression>(layers));
+    c.push_back(vector<Expression>(layers));
+  }
+  unsigned n_prev_state = 0;
+  for (unsigned k = 0; k < K; ++k)
+    if (prev[k] >= 0 || has_initial_state) ++n_prev_state;
+  // sequences without a previous state see h = c = 0, which leaves the
+  // cell unchanged, so a mixed batch can still be computed in one go
+  const bool has_prev_state = (n_prev_state > 0);
+  ComputationGraph& cg = *xs[0].pg;
+  Expression in = concatenate_to_batch(xs);
+  for (unsigned i = 0; i < layers; ++i) {
+    const vector<Expression>& vars = param_vars[i];
+    Expression i_h_tm1, i_c_tm1;
+    if (has_prev_state) {
+      vector<Expression> hs(K), cs(K);
+      Expression zero;
+      for (unsigned k = 0; k < K; ++k) {
+        if (prev[k] >= 0) {
+          hs[k] = h[prev[k]][i];
+          cs[k] = c[prev[k]][i];
+        } else if (has_initial_state) {
+          hs[k] = h0[i];
+          cs[k] = c0[i];
+        } else {
+          if (!zero.pg) zero = zeroes(cg, params[i][BI]->dim);
+          hs[k] = cs[k] = zero;
+        }
+      }
+      i_h_tm1 = concatenate_to_batch(hs);
+      i_c_tm1 = concatenate_to_batch(cs);
+    }
+    if (dropout_rate) in = dropout(in, dropout_rate);
+    vector<Expression> args = vars;
+    args.push_back(in);
+    if (has_prev_state) {
+      args.push_back(i_h_tm1);
+      args.push_back(i_c_tm1);
+    }
+    const unsigned hidden_dim = params[i][BI]->dim.rows();
+    Expression i_hct = lstm_cell(args);
+    Expression i_ct = pickrange(i_hct, hidden_dim, 2 * hidden_dim);
+    in = pickrange(i_hct, 0, hidden_dim);
+    for (unsigned k = 0; k < K; ++k) {
+      c[first + k][i] = pick_batch_elem(i_ct, k);
+      h[first + k][i] = pick_batch_elem(in, k);
+    }
+  }
+}
+
+// the input projections of all the steps of a layer are computed with one
+// GEMM per gate, with the steps stacked along the batch dimension; only the
+// recurrent part of the cell is then run step by step
+vector<Expression> LSTMBuilder::add_inputs_impl(int prev, const vector<Expression>& xs) {
+  const unsigned n = xs.size();
+  if (n < 2) return RNNBuilder::add_inputs_impl(prev, xs);
+  const unsigned first = h.size();
+  for (unsigned t = 0; t < n; ++t) {
+    h.push_back(vector<Expression>(layers));
+    c.push_back(vector<Expression>(layers));
+  }
+  vector<Expression> in = xs;
+  for (unsigned i = 0; i < layers; ++i) {
+    const vector<Expression>& vars = param_vars[i];
+    const unsigned hidden_dim = params[i][BI]->dim.rows();
+    Expression x = concatenate_to_batch(in);
+    if (dropout_rate) x = dropout(x, dropout_rate);
+    vector<Expression> args = vars;
+    args.push_back(affine_transform({vars[BI], vars[X2I], x}));
+    args.push_back(affine_transform({vars[BC], vars[X2C], x}));
+    args.push_back(affine_transform({vars[BO], vars[X2O], x}));
+    for (unsigned t = 0; t < n; ++t) {
+      const int p = t ? first + t - 1 : prev;
+      args.resize(BC + 4);
+      if (p >= 0) {
+        args.push_back(h[p][i]);
+        args.push_back(c[p][i]);
+      } else if (has_initial_state) {
+        args.push_back(h0[i]);
+        args.push_back(c0[i]);
+      }
+      Expression i_hct = lstm_cell(args, t);
+      c[first + t][i] = pickrange(i_hct, hidden_dim, 2 * hidden_dim);
+      in[t] = h[first + t][i] = pickrange(i_hct, 0, hidden_dim);
+    }
+  }
+  if (dropout_rate)
+    for (auto& y : in) y = dropout(y, dropout_rate);
+  return in;
+}
+
+unsigned LSTMBuilder::state_size() const {
+  return layers * 2 * params[0][BI]->dim.rows();
+}
+
+static inline unsigned aligned_floats(unsigned n) { return (n + 7) & ~7u; }
+
+// scratch holds the LSTMCell aux memory, then for several steps the inputs
+// of a layer side by side and the three gate input projections
+unsigned LSTMBuilder::scratch_size(unsigned n) const {
+  const unsigned hidden_dim = params[0][BI]->dim.rows();
+  const unsigned input_dim = max(params[0][X2I]->dim.cols(), hidden_dim);
+  unsigned size = aligned_floats(LSTMCell::aux_size(Dim({2 * hidden_dim})) / sizeof(float));
+  if (n > 1) size += aligned_floats(input_dim * n) + 3 * aligned_floats(hidden_dim * n);
+  return size;
+}
+
+const float* LSTMBuilder::state_h(const float* state) const {
+  return state + state_size() - 2 * params.back()[BI]->dim.rows();
+}
+
+void LSTMBuilder::step(const float* prev, const float* x, float* state, float* scratch) const {
+  const unsigned hidden_dim = params[0][BI]->dim.rows();
+  Tensor in(Dim({params[0][X2I]->dim.cols()}), const_cast<float*>(x));
+  for (unsigned i = 0; i < layers; ++i) {
+    const Tensor* args[LSTMCell::X + 3];
+    for (unsigned j = 0; j < LSTMCell::X; ++j) args[j] = &params[i][j]->values;
+    args[LSTMCell::X] = &in;
+    Tensor h_tm1, c_tm1;
+    if (prev) {
+      h_tm1 = Tensor(Dim({hidden_dim}), const_cast<float*>(prev) + 2 * i * hidden_dim);
+      c_tm1 = Tensor(Dim({hidden_dim}), h_tm1.v + hidden_dim);
+      args[LSTMCell::X + 1] = &h_tm1;
+      args[LSTMCell::X + 2] = &c_tm1;
+    }
+    Tensor hct(Dim({2 * hidden_dim}), state + 2 * i * hidden_dim);
+    LSTMCell::compute(args, prev ? LSTMCell::X + 3 : LSTMCell::X + 1, -1, scratch, hct);
+    in = Tensor(Dim({hidden_dim}), hct.v);
+  }
+}
+
+void LSTMBuilder::steps(const float* prev, const vector<const float*>& xs,
+                        const vector<float*>& states, float* scratch) const {
+  const unsigned n = xs.size();
+  assert(states.size() == n);
+  if (n < 2) {
+    if (n) step(prev, xs[0], states[0], scratch);
+    return;
+  }
+  const unsigned hidden_dim = params[0][BI]->dim.rows();
+  unsigned input_dim = params[0][X2I]->dim.cols();
+  float* aux = scratch;
+  float* in = aux + aligned_floats(LSTMCell::aux_size(Dim({2 * hidden_dim})) / sizeof(float));
+  float* proj = in + aligned_floats(max(input_dim, hidden_dim) * n);
+  for (unsigned t = 0; t < n; ++t)
+    memcpy(in + t * input_dim, xs[t], input_dim * sizeof(float));
+  static const unsigned bias[3] = {BI, BC, BO}, weight[3] = {X2I, X2C, X2O};
+  for (unsigned i = 0; i < layers; ++i) {
+    const vector<Parameters*>& p = params[i];
+    const Tensor x(Dim({input_dim}, n), in);
+    Tensor gates[3];
+    const Tensor* args[LSTMCell::X + 5];
+    for (unsigned j = 0; j < LSTMCell::X; ++j) args[j] = &p[j]->values;
+    // the same sums as affine_transform({b, W, x})
+    for (unsigned k = 0; k < 3; ++k) {
+      gates[k] = Tensor(Dim({hidden_dim}, n), proj + k * aligned_floats(hidden_dim * n));
+      gates[k].rowcol_matrix().colwise() = p[bias[k]]->values.vec();
+      gates[k].colbatch_matrix().noalias() += *p[weight[k]]->values * x.colbatch_matrix();
+      args[LSTMCell::X + k] = &gates[k];
+    }
+    for (unsigned t = 0; t < n; ++t) {
+      const float* hp = t ? states[t - 1] : prev;
+      Tensor h_tm1, c_tm1;
+      if (hp) {
+        h_tm1 = Tensor(Dim({hidden_dim}), const_cast<float*>(hp) + 2 * i * hidden_dim);
+        c_tm1 = Tensor(Dim({hidden_dim}), h_tm1.v + hidden_dim);
+        args[LSTMCell::X + 3] = &h_tm1;
+        args[LSTMCell::X + 4] = &c_tm1;
+      }
+      Tensor hct(Dim({2 * hidden_dim}), states[t] + 2 * i * hidden_dim);
+      LSTMCell::compute(args, hp ? LSTMCell::X + 5 : LSTMCell::X + 3, t, aux, hct);
+    }
+    // the next layer reads the h of every step as one matrix
+    input_dim = hidden_dim;
+    if (i + 1 < layers)
+      for (unsigned t = 0; t < n; ++t)
+        memcpy(in + t * hidden_dim, states[t] + 2 * i * hidden_dim, hidden_dim * sizeof(float));
+  }
+}
+
 void LSTMBuilder::copy(const RNNBuilder & rnn) {
   const LSTMBuilder & rnn_lstm = (const LSTMBuilder&)rnn;
   assert(params.size() == rnn_lstm.params.size());
@@ -39,10 +39,28 @@ struct LSTMBuilder : public RNNBuilder {
   }
 
   void copy(const RNNBuilder & params) override;
+
+  // graph-free inference with the current parameter values, for decoding
+  // without building a ComputationGraph. a state holds [h; c] of every layer
+  // in state_size() floats and prev == nullptr starts a new sequence;
+  // dropout and initial states are ignored. scratch must be 32-byte aligned
+  // and hold scratch_size(n) floats for n inputs
+  unsigned state_size() const;
+  unsigned scratch_size(unsigned n = 1) const;
+  void step(const float* prev, const float* x, float* state, float* scratch) const;
+  // as add_inputs: the input projections of all the steps are one GEMM per
+  // gate and layer, and states[t] continues states[t - 1]
+  void steps(const float* prev, const std::vector<const float*>& xs,
+             const std::vector<float*>& states, float* scratch) const;
+  // h of the top layer
+  const float* state_h(const float* state) const;
  protected:
   void new_graph_impl(ComputationGraph& cg) override;
   void start_new_sequence_impl(const std::vector<Expression>& h0) override;
   Expression add_input_impl(int prev, const Expression& x) override;
+  void add_input_batch_impl(const std::vector<RNNPointer>& prev,
+                            const std::vector<Expression>& xs) override;
+  std::vector<Expression> add_inputs_impl(int prev, const std::vector<Expression>& xs) override;
 
  public:
   // first index is layer, then ...
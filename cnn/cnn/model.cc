@@ -2,12 +2,19 @@
 #include "cnn/tensor.h"
 #include "cnn/aligned-mem-pool.h"
 #include "cnn/cnn.h"
+#include "cnn/thread-pool.h"
 
-#include <unordered_set>
 #include <iostream>
 
 #include <fstream>
 #include <sstream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 
@@ -22,8 +29,12 @@ namespace cnn {
 
 ParametersBase::~ParametersBase() {}
 
-Parameters::Parameters(const Dim& d, float scale) : dim(d) {
+Parameters::Parameters(const Dim& d, float scale, bool storage) : dim(d) {
   values.d = g.d = d;
+  if (!storage) {
+    values.v = g.v = nullptr;
+    return;
+  }
   values.v = static_cast<float*>(ps->allocate(d.size() * sizeof(float)));
   if (scale) {
     TensorTools::Randomize(values, scale);
@@ -74,23 +85,52 @@ void Parameters::clear() {
   TensorTools::Zero(g);
 }
 
-LookupParameters::LookupParameters(unsigned n, const Dim& d) : dim(d), values(n), grads(n) {
+LookupParameters::LookupParameters(unsigned n, const Dim& d, bool storage) :
+    dim(d), values(n), grads(n), non_zero_grads(n) {
+  if (!storage) {
+    stride = d.size();
+    all_values.d = all_grads.d = Dim({stride, n});
+    all_values.v = all_grads.v = nullptr;
+    for (unsigned i = 0; i < n; ++i) {
+      values[i].d = grads[i].d = d;
+      values[i].v = grads[i].v = nullptr;
+    }
+    return;
+  }
+  stride = default_device->mem->round_up_align(d.size() * sizeof(float)) / sizeof(float);
+  all_values.d = all_grads.d = Dim({stride, n});
+  all_values.v = static_cast<float*>(ps->allocate(stride * n * sizeof(float)));
+  all_grads.v = static_cast<float*>(ps->allocate(stride * n * sizeof(float)));
+  TensorTools::Zero(all_values);
+  TensorTools::Zero(all_grads);
   for (unsigned i = 0; i < n; ++i) {
     auto& v = values[i];
     v.d = d;
-    v.v = static_cast<float*>(ps->allocate(d.size() * sizeof(float)));
+    v.v = all_values.v + i * stride;
     TensorTools::Randomize(v);
 
     auto& g = grads[i];
     g.d = d;
-    g.v = static_cast<float*>(ps->allocate(d.size() * sizeof(float)));
-    TensorTools::Zero(g);
+    g.v = all_grads.v + i * stride;
   }
 }
 
+void LookupParameters::set_loaded_row(unsigned i, Tensor& row) {
+  if (row.d != dim)
+    throw std::runtime_error("Lookup table row does not match the parameter dimensions");
+  if (!values[i].v)
+    throw std::runtime_error("The model has no parameter storage to load into");
+#if HAVE_CUDA
+  CUDA_CHECK(cudaMemcpy(values[i].v, row.v, dim.size() * sizeof(float), cudaMemcpyDeviceToDevice));
+  CUDA_CHECK(cudaFree(row.v));
+#else
+  memcpy(values[i].v, row.v, dim.size() * sizeof(float));
+  _mm_free(row.v);
+#endif
+}
+
 void LookupParameters::scale_parameters(float a) {
-  for (auto& p : values)
-    (*p) *= a;
+  (*all_values) *= a;
 }
 
 void LookupParameters::Initialize(unsigned index, const vector<float>& val) {
@@ -110,13 +150,13 @@ size_t LookupParameters::size() const {
 void LookupParameters::g_squared_l2norm(float* sqnorm) const {
 #if HAVE_CUDA
   bool acc = false;
-  for (auto i : non_zero_grads) {
+  for (auto i : touched_rows()) {
     gpu::l2_norm_reducer(grads[i].d.size(), grads[i].v, sqnorm, true, acc);
     acc = true;
   }
 #else
   real a = 0;
-  for (auto i : non_zero_grads)
+  for (auto i : touched_rows())
     a += (*grads[i]).squaredNorm();
   *sqnorm = a;
 #endif
@@ -124,23 +164,20 @@ void LookupParameters::g_squared_l2norm(float* sqnorm) const {
 
 void LookupParameters::squared_l2norm(float* sqnorm) const {
 #if HAVE_CUDA
-  bool acc = false;
-  for (unsigned i = 0; i < values.size(); ++i) {
-    gpu::l2_norm_reducer(values[i].d.size(), values[i].v, sqnorm, true, acc);
-    acc = true;
-  }
+  gpu::l2_norm_reducer(all_values.d.size(), all_values.v, sqnorm, true, false);
 #else
-  float a = 0;
-  for (unsigned i = 0; i < values.size(); ++i)
-    a += (*values[i]).squaredNorm();
-  *sqnorm = a;
+  *sqnorm = all_values.vec().squaredNorm();
 #endif
 }
 
 void LookupParameters::copy(const LookupParameters & param) {
-  assert(dim == param.dim);
-  for(size_t i = 0; i < param.values.size(); ++i)
-    TensorTools::CopyElements(values[i], param.values[i]);
+  assert(dim == param.dim && values.size() == param.values.size());
+  if (stride == param.stride) {
+    TensorTools::CopyElements(all_values, param.all_values);
+  } else {
+    for(size_t i = 0; i < param.values.size(); ++i)
+      TensorTools::CopyElements(values[i], param.values[i]);
+  }
 }
 
 void LookupParameters::accumulate_grad(unsigned index, const Tensor& d) {
@@ -153,13 +190,20 @@ void LookupParameters::accumulate_grad(unsigned index, const Tensor& d) {
 }
 
 void LookupParameters::clear() {
-  for (auto i : non_zero_grads)
+  for (auto i : touched_rows())
     TensorTools::Zero(grads[i]);
   non_zero_grads.clear();
 }
 
 Model::~Model() {
   for (auto p : all_params) delete p;
+  release_mapping();
+}
+
+void Model::release_mapping() {
+  if (mapped_data) munmap(mapped_data, mapped_size);
+  mapped_data = nullptr;
+  mapped_size = 0;
 }
 
 void Model::project_weights(float radius) {
@@ -177,7 +221,45 @@ void Model::project_weights(float radius) {
   cerr << "NORM: " << sqrt(gg) << endl;
 }
 
-float Model::gradient_l2_norm() const {
+float Model::gradient_l2_norm(ThreadPool* pool) const {
+#if !HAVE_CUDA
+  if (pool && pool->size() > 1) {
+    // a range of the gradient of a parameter, or of the touched rows of a
+    // lookup parameter if lp is not null
+    struct Chunk {
+      const float* g;
+      const LookupParameters* lp;
+      const unsigned* rows;
+      unsigned n;
+    };
+    const unsigned kElements = 1 << 15, kRows = 256;
+    vector<Chunk> chunks;
+    for (auto p : params)
+      for (unsigned b = 0; b < p->g.d.size(); b += kElements)
+        chunks.push_back({p->g.v + b, nullptr, nullptr, min(kElements, p->g.d.size() - b)});
+    for (auto p : lookup_params) {
+      const vector<unsigned>& rows = p->touched_rows();
+      for (unsigned b = 0; b < rows.size(); b += kRows)
+        chunks.push_back({nullptr, p, rows.data() + b, min(kRows, (unsigned)rows.size() - b)});
+    }
+    vector<float> sums(chunks.size());
+    pool->run(chunks.size(), [&](unsigned i) {
+      const Chunk& c = chunks[i];
+      if (!c.lp) {
+        sums[i] = Eigen::Map<const Eigen::VectorXf>(c.g, c.n).squaredNorm();
+      } else {
+        real a = 0;
+        for (unsigned r = 0; r < c.n; ++r)
+          a += (*c.lp->grads[c.rows[r]]).squaredNorm();
+        sums[i] = a;
+      }
+    });
+    double gg = 0;
+    for (auto a : sums)
+      gg += a;
+    return sqrt(gg);
+  }
+#endif
   if (!gradient_norm_scratch)
     gradient_norm_scratch = (float*)default_device->mem->malloc(all_params.size() * sizeof(float));
   int pi = 0;
@@ -199,14 +281,14 @@ float Model::gradient_l2_norm() const {
 }
 
 Parameters* Model::add_parameters(const Dim& d, float scale) {
-  Parameters* p = new Parameters(d, scale);
+  Parameters* p = new Parameters(d, scale, !deferred_storage);
   all_params.push_back(p);
   params.push_back(p);
   return p;
 }
 
 LookupParameters* Model::add_lookup_parameters(unsigned n, const Dim& d) {
-  LookupParameters* p = new LookupParameters(n,d);
+  LookupParameters* p = new LookupParameters(n, d, !deferred_storage);
   all_params.push_back(p);
   lookup_params.push_back(p);
   return p;
@@ -229,4 +311,276 @@ void load_cnn_model(std::string filename, Model* model) {
     ia >> (*model);
 };
 
+// binary model layout (all integers and floats little-endian):
+//   char[8]  magic "CNNMODEL"
+//   uint32   format version
+//   uint32   number of Parameters
+//   uint32   number of LookupParameters
+//   uint32   reserved (0)
+//   for each Parameters:       uint32 ndims, uint32 dims[ndims], uint64 offset
+//   for each LookupParameters: uint32 nrows, uint32 ndims, uint32 dims[ndims], uint64 offset
+//   float blocks, each starting at its offset (a multiple of 32); the rows
+//     of a LookupParameters are stored one after another
+//   uint64   checksum of every preceding byte
+namespace {
+
+const char kBinaryModelMagic[8] = {'C','N','N','M','O','D','E','L'};
+const uint32_t kBinaryModelVersion = 1;
+const size_t kBinaryModelAlign = 32;
+
+bool host_is_little_endian() {
+  const uint32_t one = 1;
+  return *reinterpret_cast<const char*>(&one) == 1;
+}
+
+size_t align_up(size_t x) {
+  return (x + kBinaryModelAlign - 1) / kBinaryModelAlign * kBinaryModelAlign;
+}
+
+// 64-bit FNV-1a, but consuming 8 bytes per step so that hashing keeps up
+// with disk bandwidth
+uint64_t model_checksum(const char* data, size_t n) {
+  uint64_t h = 14695981039346656037ULL;
+  const uint64_t prime = 1099511628211ULL;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, data + i, 8);
+    h = (h ^ w) * prime;
+  }
+  for (; i < n; ++i)
+    h = (h ^ static_cast<unsigned char>(data[i])) * prime;
+  return h;
+}
+
+template <typename T> void put(string& buf, T x) {
+  buf.append(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+template <typename T> T get(const char* data, size_t size, size_t& pos) {
+  if (pos + sizeof(T) > size)
+    throw std::runtime_error("Truncated binary model header");
+  T x;
+  memcpy(&x, data + pos, sizeof(T));
+  pos += sizeof(T);
+  return x;
+}
+
+void put_dim(string& buf, const Dim& d) {
+  put<uint32_t>(buf, d.ndims());
+  for (unsigned i = 0; i < d.ndims(); ++i) put<uint32_t>(buf, d[i]);
+}
+
+void check_dim(const char* data, size_t size, size_t& pos, const Dim& d) {
+  const uint32_t nd = get<uint32_t>(data, size, pos);
+  bool match = (nd == d.ndims());
+  for (unsigned i = 0; i < nd; ++i) {
+    const uint32_t di = get<uint32_t>(data, size, pos);
+    if (match && di != d[i]) match = false;
+  }
+  if (!match) {
+    ostringstream os; os << "Binary model does not match the parameter dimensions " << d;
+    throw std::runtime_error(os.str());
+  }
+}
+
+void copy_from_host(float* dst, const char* src, size_t n) {
+#if HAVE_CUDA
+  CUDA_CHECK(cudaMemcpy(dst, src, n * sizeof(float), cudaMemcpyHostToDevice));
+#else
+  memcpy(dst, src, n * sizeof(float));
+#endif
+}
+
+void copy_to_host(char* dst, const float* src, size_t n) {
+#if HAVE_CUDA
+  CUDA_CHECK(cudaMemcpy(dst, src, n * sizeof(float), cudaMemcpyDeviceToHost));
+#else
+  memcpy(dst, src, n * sizeof(float));
+#endif
+}
+
+} // namespace
+
+void save_cnn_model_binary(const std::string& filename, const Model& model) {
+  if (!host_is_little_endian())
+    throw std::runtime_error("Binary models can only be written on little-endian hosts");
+  const auto& params = model.parameters_list();
+  const auto& lookup_params = model.lookup_parameters_list();
+  // the offsets are only known once the header size is; write the header
+  // with placeholder offsets and patch them afterwards
+  string buf(kBinaryModelMagic, sizeof(kBinaryModelMagic));
+  put<uint32_t>(buf, kBinaryModelVersion);
+  put<uint32_t>(buf, params.size());
+  put<uint32_t>(buf, lookup_params.size());
+  put<uint32_t>(buf, 0);
+  vector<size_t> offset_pos;
+  for (auto p : params) {
+    put_dim(buf, p->dim);
+    offset_pos.push_back(buf.size());
+    put<uint64_t>(buf, 0);
+  }
+  for (auto p : lookup_params) {
+    put<uint32_t>(buf, p->values.size());
+    put_dim(buf, p->dim);
+    offset_pos.push_back(buf.size());
+    put<uint64_t>(buf, 0);
+  }
+  unsigned oi = 0;
+  for (auto p : params) {
+    const uint64_t offset = align_up(buf.size());
+    memcpy(&buf[offset_pos[oi++]], &offset, sizeof(offset));
+    buf.resize(offset + p->dim.size() * sizeof(float));
+    copy_to_host(&buf[offset], p->values.v, p->dim.size());
+  }
+  for (auto p : lookup_params) {
+    const uint64_t offset = align_up(buf.size());
+    memcpy(&buf[offset_pos[oi++]], &offset, sizeof(offset));
+    const size_t row = p->dim.size();
+    buf.resize(offset + p->values.size() * row * sizeof(float));
+    if (p->stride == row) {
+      copy_to_host(&buf[offset], p->all_values.v, p->values.size() * row);
+    } else {
+      for (unsigned i = 0; i < p->values.size(); ++i)
+        copy_to_host(&buf[offset + i * row * sizeof(float)], p->values[i].v, row);
+    }
+  }
+  put<uint64_t>(buf, model_checksum(buf.data(), buf.size()));
+  ofstream out(filename, ios::binary);
+  out.write(buf.data(), buf.size());
+  if (!out)
+    throw std::runtime_error("Could not write binary model to " + filename);
+}
+
+namespace {
+
+// reads a binary model held in memory into model. with zero_copy the
+// parameter values are left pointing into data, which must then outlive
+// the model's use of them.
+void read_binary_model(const char* data, size_t size, const std::string& filename,
+                       Model* model, bool verify_checksum, bool zero_copy) {
+  if (!host_is_little_endian())
+    throw std::runtime_error("Binary models can only be read on little-endian hosts");
+  if (size < sizeof(kBinaryModelMagic) + 8 || memcmp(data, kBinaryModelMagic, sizeof(kBinaryModelMagic)))
+    throw std::runtime_error(filename + " is not a binary model");
+  if (verify_checksum) {
+    uint64_t stored_checksum;
+    memcpy(&stored_checksum, data + size - 8, 8);
+    if (model_checksum(data, size - 8) != stored_checksum)
+      throw std::runtime_error("Checksum mismatch in binary model " + filename);
+  }
+  const size_t data_size = size - 8;
+  size_t pos = sizeof(kBinaryModelMagic);
+  const uint32_t version = get<uint32_t>(data, data_size, pos);
+  if (version != kBinaryModelVersion) {
+    ostringstream os; os << "Unsupported binary model version " << version << " in " << filename;
+    throw std::runtime_error(os.str());
+  }
+  if (model->storage_deferred() && !zero_copy)
+    throw std::runtime_error("The model has no parameter storage; map " + filename + " with load_cnn_model_mmap");
+  const auto& params = model->parameters_list();
+  const auto& lookup_params = model->lookup_parameters_list();
+  const uint32_t np = get<uint32_t>(data, data_size, pos);
+  const uint32_t nlp = get<uint32_t>(data, data_size, pos);
+  get<uint32_t>(data, data_size, pos);
+  if (np != params.size() || nlp != lookup_params.size())
+    throw std::runtime_error("Binary model " + filename + " has a different number of parameters than the model");
+  vector<uint64_t> offsets;
+  for (auto p : params) {
+    check_dim(data, data_size, pos, p->dim);
+    offsets.push_back(get<uint64_t>(data, data_size, pos));
+  }
+  for (auto p : lookup_params) {
+    if (get<uint32_t>(data, data_size, pos) != p->values.size())
+      throw std::runtime_error("Binary model " + filename + " has a lookup table of a different size than the model");
+    check_dim(data, data_size, pos, p->dim);
+    offsets.push_back(get<uint64_t>(data, data_size, pos));
+  }
+  // check every block before touching the model, so a bad file leaves it unchanged
+  unsigned oi = 0;
+  for (auto p : params)
+    if (offsets[oi++] + p->dim.size() * sizeof(float) > data_size)
+      throw std::runtime_error("Truncated binary model " + filename);
+  for (auto p : lookup_params)
+    if (offsets[oi++] + p->values.size() * p->dim.size() * sizeof(float) > data_size)
+      throw std::runtime_error("Truncated binary model " + filename);
+  oi = 0;
+  for (auto p : params) {
+    const char* block = data + offsets[oi++];
+    if (zero_copy)
+      p->values.v = reinterpret_cast<float*>(const_cast<char*>(block));
+    else
+      copy_from_host(p->values.v, block, p->dim.size());
+  }
+  for (auto p : lookup_params) {
+    const char* block = data + offsets[oi++];
+    const size_t row = p->dim.size();
+    if (zero_copy) {
+      // the mapped rows are not padded
+      p->stride = row;
+      p->all_values.d = Dim({p->stride, (unsigned)p->values.size()});
+      p->all_values.v = reinterpret_cast<float*>(const_cast<char*>(block));
+      for (unsigned i = 0; i < p->values.size(); ++i)
+        p->values[i].v = p->all_values.v + i * row;
+    } else if (p->stride == row) {
+      copy_from_host(p->all_values.v, block, p->values.size() * row);
+    } else {
+      for (unsigned i = 0; i < p->values.size(); ++i)
+        copy_from_host(p->values[i].v, block + i * row * sizeof(float), row);
+    }
+  }
+}
+
+} // namespace
+
+void load_cnn_model_binary(const std::string& filename, Model* model) {
+  ifstream in(filename, ios::binary | ios::ate);
+  if (!in)
+    throw std::runtime_error("Could not open binary model " + filename);
+  const size_t size = in.tellg();
+  in.seekg(0);
+  vector<char> buf(size);
+  if (!in.read(buf.data(), size))
+    throw std::runtime_error("Could not read binary model " + filename);
+  read_binary_model(buf.data(), size, filename, model, true, false);
+}
+
+void load_cnn_model_mmap(const std::string& filename, Model* model, bool verify_checksum) {
+#if HAVE_CUDA
+  throw std::runtime_error("Memory-mapped models are not supported with CUDA");
+#else
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Could not open binary model " + filename);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw std::runtime_error("Could not stat binary model " + filename);
+  }
+  const size_t size = st.st_size;
+  void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    throw std::runtime_error("Could not map binary model " + filename);
+  try {
+    read_binary_model(static_cast<const char*>(addr), size, filename, model, verify_checksum, true);
+  } catch (...) {
+    munmap(addr, size);
+    throw;
+  }
+  // lookup parameters are used a row at a time (most pretrained embedding
+  // rows never are), so only page in what is touched
+  madvise(addr, size, MADV_RANDOM);
+  model->release_mapping();
+  model->mapped_data = addr;
+  model->mapped_size = size;
+#endif
+}
+
+bool is_binary_cnn_model(const std::string& filename) {
+  ifstream in(filename, ios::binary);
+  char magic[sizeof(kBinaryModelMagic)];
+  return in.read(magic, sizeof(magic)) && !memcmp(magic, kBinaryModelMagic, sizeof(magic));
+}
+
 } // namespace cnn
@@ -2,8 +2,8 @@
 #define CNN_PARAMS_H_
 
 #include <vector>
-#include <unordered_set>
 #include <string>
+#include <algorithm>
 
 
 #include <boost/serialization/split_member.hpp>
@@ -45,8 +45,9 @@ struct Parameters : public ParametersBase {
   Tensor g;
  private:
   Parameters() {}
-  explicit Parameters(const Dim& d, float minmax); // initialize with ~U(-minmax,+minmax)
-                                 // or Glorot initialization if minmax = 0
+  // initialize with ~U(-minmax,+minmax) or Glorot initialization if
+  // minmax = 0; without storage, values and g are left null
+  Parameters(const Dim& d, float minmax, bool storage);
   friend class boost::serialization::access;
   template<class Archive> void serialize(Archive& ar, const unsigned int) {
     ar & dim;
@@ -54,6 +55,39 @@ struct Parameters : public ParametersBase {
   }
 };
 
+// a set of rows of a lookup table, such as those with a nonzero gradient:
+// a bitmap answers membership and a list holds the rows, which rows() sorts
+// so that the updates go through the table in memory order
+class TouchedRows {
+ public:
+  explicit TouchedRows(unsigned n = 0) : marked(n), sorted(true) {}
+  void insert(unsigned i) {
+    if (marked[i]) return;
+    marked[i] = true;
+    if (!list.empty() && i < list.back()) sorted = false;
+    list.push_back(i);
+  }
+  bool count(unsigned i) const { return marked[i]; }
+  bool empty() const { return list.empty(); }
+  unsigned size() const { return list.size(); }
+  const std::vector<unsigned>& rows() const {
+    if (!sorted) {
+      std::sort(list.begin(), list.end());
+      sorted = true;
+    }
+    return list;
+  }
+  void clear() {
+    for (auto i : list) marked[i] = false;
+    list.clear();
+    sorted = true;
+  }
+ private:
+  std::vector<bool> marked;
+  mutable std::vector<unsigned> list;
+  mutable bool sorted;
+};
+
 // represents a matrix/vector embedding of a discrete set
 struct LookupParameters : public ParametersBase {
   friend class Model;
@@ -68,13 +102,26 @@ struct LookupParameters : public ParametersBase {
   void clear();
 
   Dim dim;
+  // the rows are stored one after another in all_values and all_grads, each
+  // starting stride floats after the previous one (dim.size() rounded up so
+  // that every row stays aligned; the padding is zero). values and grads
+  // are views of the rows
+  unsigned stride;
+  Tensor all_values;
+  Tensor all_grads;
   std::vector<Tensor> values;
   std::vector<Tensor> grads;
   // gradients are sparse, so track which components are nonzero
-  std::unordered_set<unsigned> non_zero_grads;
+  TouchedRows non_zero_grads;
+  // the rows with a nonzero gradient, in increasing order
+  const std::vector<unsigned>& touched_rows() const { return non_zero_grads.rows(); }
  private:
   LookupParameters() {}
-  LookupParameters(unsigned n, const Dim& d);
+  // without storage, the rows are left null
+  LookupParameters(unsigned n, const Dim& d, bool storage);
+  // copies a row read by Tensor::load, which gives it a buffer of its own,
+  // into row i of all_values and frees that buffer
+  void set_loaded_row(unsigned i, Tensor& row);
   friend class boost::serialization::access;
   template<class Archive>
   void save(Archive& ar, const unsigned int) const {
@@ -90,8 +137,11 @@ struct LookupParameters : public ParametersBase {
     int nv;
     ar & nv;
     assert(nv == (int)values.size());
-    for (unsigned i = 0; i < values.size(); ++i)
-      ar & values[i];
+    for (unsigned i = 0; i < values.size(); ++i) {
+      Tensor row;
+      ar & row;
+      set_loaded_row(i, row);
+    }
   }
   BOOST_SERIALIZATION_SPLIT_MEMBER()
 };
@@ -100,17 +150,27 @@ struct LookupParameters : public ParametersBase {
 // if you need a matrix of parameters, or a lookup table - ask an instance of this class
 // this knows how to serialize itself
 // parameters know how to track their gradients, but any extra information (like velocity) will live here
+class ThreadPool;
+
 class Model {
  public:
-  Model() : gradient_norm_scratch() {}
+  Model() : gradient_norm_scratch(), mapped_data(), mapped_size(), deferred_storage(false) {}
   ~Model();
-  float gradient_l2_norm() const;
+  // with a pool of more than one thread, the sum is split into chunks that do
+  // not depend on the number of threads, and is added up in the order of the
+  // chunks, so that it is the same for any number of threads
+  float gradient_l2_norm(ThreadPool* pool = nullptr) const;
   void reset_gradient();
   // set scale to use custom initialization
   Parameters* add_parameters(const Dim& d, float scale = 0.0f);
   LookupParameters* add_lookup_parameters(unsigned n, const Dim& d);
   // project weights so their L2 norm = radius
   void project_weights(float radius = 1.0f);
+  // parameters added after this call get no memory and are not initialized;
+  // their values must come from load_cnn_model_mmap. a process that maps its
+  // model then never allocates, or writes to, the tables the mapping replaces
+  void defer_storage() { deferred_storage = true; }
+  bool storage_deferred() const { return deferred_storage; }
 
   const std::vector<ParametersBase*>& all_parameters_list() const { return all_params; }
   const std::vector<Parameters*>& parameters_list() const { return params; }
@@ -150,11 +210,36 @@ class Model {
   std::vector<Parameters*> params;
   std::vector<LookupParameters*> lookup_params;
   mutable float* gradient_norm_scratch;
+
+  // model file mapped by load_cnn_model_mmap, unmapped with the model
+  friend void load_cnn_model_mmap(const std::string& filename, Model* model, bool verify_checksum);
+  void release_mapping();
+  void* mapped_data;
+  size_t mapped_size;
+  bool deferred_storage;
 };
 
 void save_cnn_model(std::string filename, Model* model);
 void load_cnn_model(std::string filename, Model* model);
 
+// compact binary serialization: a versioned header with the dimensions of
+// every Parameters and LookupParameters, raw little-endian float blocks
+// (each aligned to 32 bytes) and a checksum; see model.cc for the layout.
+// as with the text archives, the model must already contain parameters of
+// the same shapes, in the same order, as the saved one.
+void save_cnn_model_binary(const std::string& filename, const Model& model);
+void load_cnn_model_binary(const std::string& filename, Model* model);
+// like load_cnn_model_binary, but maps the file read-only and points the
+// parameter values directly at the mapped pages instead of copying them, so
+// processes loading the same file share one physical copy and pages are
+// only read when first used. the values must not be written to (inference
+// only). verifying the checksum reads the whole file. for the pages to be
+// shared, the model should be built after Model::defer_storage, so that its
+// own copy of the parameters is never allocated.
+void load_cnn_model_mmap(const std::string& filename, Model* model, bool verify_checksum = false);
+// true if filename starts with the binary model magic
+bool is_binary_cnn_model(const std::string& filename);
+
 } // namespace cnn
 
 #endif
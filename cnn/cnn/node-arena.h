@@ -0,0 +1,78 @@
+#ifndef CNN_NODE_ARENA_H
+#define CNN_NODE_ARENA_H
+
+#include <cstdlib>
+#include <cstddef>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+
+namespace cnn {
+
+// bump allocator for the nodes of a ComputationGraph. the memory comes in
+// blocks that are kept when the arena is reset, so a graph that is cleared
+// and rebuilt for every sentence stops calling malloc as soon as the blocks
+// are large enough for its largest graph.
+class NodeArena {
+ public:
+  NodeArena() : current(0), used(0) {}
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+  ~NodeArena() {
+    for (auto& b : blocks) std::free(b.mem);
+  }
+
+  void* allocate(size_t n) {
+    n = (n + kAlign - 1) & ~(kAlign - 1);
+    for (; current < blocks.size(); ++current, used = 0) {
+      if (used + n <= blocks[current].size) {
+        void* res = static_cast<char*>(blocks[current].mem) + used;
+        used += n;
+        return res;
+      }
+    }
+    // each new block is at least twice as large as the last one
+    const size_t size = std::max(n, blocks.empty() ? kFirstBlock : 2 * blocks.back().size);
+    void* mem = std::malloc(size);
+    if (!mem) {
+      std::cerr << "Failed to allocate " << size << " bytes for graph nodes\n";
+      abort();
+    }
+    blocks.push_back({mem, size});
+    current = blocks.size() - 1;
+    used = n;
+    return mem;
+  }
+  // makes all the memory available again; the caller destroys the objects
+  void reset() {
+    current = 0;
+    used = 0;
+  }
+
+  // position of the next allocation; rewind(m) frees everything allocated
+  // after mark() returned m and keeps what was allocated before it
+  struct Mark {
+    size_t block;
+    size_t used;
+  };
+  Mark mark() const { return {current, used}; }
+  void rewind(const Mark& m) {
+    current = m.block;
+    used = m.used;
+  }
+
+ private:
+  static constexpr size_t kAlign = 16;
+  static constexpr size_t kFirstBlock = 1 << 16;
+  struct Block {
+    void* mem;
+    size_t size;
+  };
+  std::vector<Block> blocks;
+  size_t current;  // block being filled
+  size_t used;  // bytes used in it
+};
+
+} // namespace cnn
+
+#endif
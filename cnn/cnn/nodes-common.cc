@@ -403,6 +403,45 @@ Dim SumBatches::dim_forward(const vector<Dim>& xs) const {
   return xs[0].single_batch();
 }
 
+string ConcatenateToBatch::as_string(const vector<string>& arg_names) const {
+  ostringstream os;
+  os << "concat_batch_elems(" << arg_names[0];
+  for (unsigned i = 1; i < arg_names.size(); ++i)
+    os << ',' << arg_names[i];
+  os << ')';
+  return os.str();
+}
+
+Dim ConcatenateToBatch::dim_forward(const vector<Dim>& xs) const {
+  assert(xs.size() > 0);
+  Dim d = xs[0].single_batch();
+  unsigned bd = 0;
+  for (auto& x : xs) {
+    if (x.single_batch() != d) {
+      ostringstream s; s << "Mismatched input dimensions in ConcatenateToBatch: " << xs;
+      throw std::invalid_argument(s.str());
+    }
+    bd += x.bd;
+  }
+  d.bd = bd;
+  return d;
+}
+
+string PickBatchElement::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "pick_batch_elem(" << arg_names[0] << ',' << index << ')';
+  return s.str();
+}
+
+Dim PickBatchElement::dim_forward(const vector<Dim>& xs) const {
+  assert(xs.size() == 1);
+  if (index >= xs[0].bd) {
+    ostringstream s; s << "Bad batch index " << index << " in PickBatchElement: " << xs;
+    throw std::invalid_argument(s.str());
+  }
+  return xs[0].single_batch();
+}
+
 string Average::as_string(const vector<string>& arg_names) const {
   ostringstream s;
   s << "average(" << arg_names[0];
@@ -699,6 +738,27 @@ Dim RestrictedLogSoftmax::dim_forward(const vector<Dim>& xs) const {
   return xs[0];
 }
 
+string MaskedArgmax::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "masked_argmax(" << arg_names[0] << ')';
+  return s.str();
+}
+
+Dim MaskedArgmax::dim_forward(const vector<Dim>& xs) const {
+  assert(xs.size() == 1);
+  if (!LooksLikeVector(xs[0]) || mask.empty()) {
+    ostringstream s; s << "Bad input dimensions in MaskedArgmax: " << xs;
+    throw std::invalid_argument(s.str());
+  }
+  for (auto i : mask) {
+    if (i >= xs[0].rows()) {
+      ostringstream s; s << "MaskedArgmax index " << i << " out of range for " << xs;
+      throw std::invalid_argument(s.str());
+    }
+  }
+  return Dim({2}, xs[0].bd);
+}
+
 string PickElement::as_string(const vector<string>& arg_names) const {
   ostringstream s;
   s << "pick(" << arg_names[0] << ',' << *pval << ')';
@@ -824,6 +884,49 @@ Dim AffineTransform::dim_forward(const vector<Dim>& xs) const {
   return d;
 }
 
+string LSTMCell::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "lstm_cell(" << arg_names[X];
+  if (step >= 0)
+    s << ", " << arg_names[X + 1] << ", " << arg_names[X + 2] << ", step=" << step;
+  if (arg_names.size() > hprev())
+    s << ", " << arg_names[hprev()] << ", " << arg_names[hprev() + 1];
+  s << ')';
+  return s.str();
+}
+
+Dim LSTMCell::dim_forward(const vector<Dim>& xs) const {
+  if (xs.size() != hprev() && xs.size() != hprev() + 2) {
+    ostringstream s; s << "Bad number of inputs in LSTMCell: " << xs;
+    throw std::invalid_argument(s.str());
+  }
+  const unsigned H = xs[BI].rows();
+  const unsigned I = xs[X2I].cols();
+  bool ok = true;
+  for (unsigned i = X2I; i <= BC; ++i)
+    ok = ok && xs[i].rows() == H && xs[i].bd == 1;
+  ok = ok && xs[BI].cols() == 1 && xs[BO].cols() == 1 && xs[BC].cols() == 1;
+  ok = ok && xs[X2O].cols() == I && xs[X2C].cols() == I;
+  ok = ok && xs[H2I].cols() == H && xs[C2I].cols() == H && xs[H2O].cols() == H &&
+       xs[C2O].cols() == H && xs[H2C].cols() == H;
+  unsigned bd = xs[X].bd;
+  if (step < 0) {
+    ok = ok && xs[X].rows() == I && xs[X].cols() == 1;
+  } else {
+    for (unsigned i = X; i < X + 3; ++i)
+      ok = ok && xs[i].rows() == H && xs[i].cols() == 1 && xs[i].bd > unsigned(step);
+    bd = 1;
+  }
+  if (xs.size() > hprev())
+    for (unsigned i = hprev(); i < xs.size(); ++i)
+      ok = ok && xs[i].rows() == H && xs[i].cols() == 1 && xs[i].bd == bd;
+  if (!ok) {
+    ostringstream s; s << "Bad dimensions for LSTMCell: " << xs;
+    throw std::invalid_argument(s.str());
+  }
+  return Dim({2 * H}, bd);
+}
+
 string Negate::as_string(const vector<string>& arg_names) const {
   ostringstream s;
   s << '-' << arg_names[0];
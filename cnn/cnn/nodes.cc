@@ -932,6 +932,52 @@ void SumBatches::backward_impl(const vector<const Tensor*>& xs,
 #endif
 }
 
+void ConcatenateToBatch::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+  unsigned offset = 0;
+  for (auto x : xs) {
+    const unsigned n = x->d.size();
+#if HAVE_CUDA
+    CUDA_CHECK(cudaMemcpyAsync(fx.v + offset, x->v, n * sizeof(float), cudaMemcpyDeviceToDevice));
+#else
+    memcpy(fx.v + offset, x->v, n * sizeof(float));
+#endif
+    offset += n;
+  }
+}
+
+void ConcatenateToBatch::backward_impl(const vector<const Tensor*>& xs,
+                                       const Tensor& fx,
+                                       const Tensor& dEdf,
+                                       unsigned i,
+                                       Tensor& dEdxi) const {
+  assert(i < xs.size());
+  unsigned offset = 0;
+  for (unsigned j = 0; j < i; ++j) offset += xs[j]->d.size();
+#if HAVE_CUDA
+  CUBLAS_CHECK(cublasSaxpy(cublas_handle, dEdxi.d.size(), kSCALAR_ONE, dEdf.v + offset, 1, dEdxi.v, 1));
+#else
+  dEdxi.vec() += Eigen::Map<Eigen::VectorXf>(dEdf.v + offset, dEdxi.d.size());
+#endif
+}
+
+void PickBatchElement::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+  assert(xs.size() == 1);
+  fx.v = const_cast<float*>(xs[0]->batch_ptr(index));
+}
+
+void PickBatchElement::backward_impl(const vector<const Tensor*>& xs,
+                                     const Tensor& fx,
+                                     const Tensor& dEdf,
+                                     unsigned i,
+                                     Tensor& dEdxi) const {
+  assert(i == 0);
+#if HAVE_CUDA
+  CUBLAS_CHECK(cublasSaxpy(cublas_handle, dEdf.d.size(), kSCALAR_ONE, dEdf.v, 1, dEdxi.batch_ptr(index), 1));
+#else
+  dEdxi.batch_matrix(index) += *dEdf;
+#endif
+}
+
 void Average::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
   const unsigned num_args = xs.size();
   if (num_args == 1) {
@@ -1380,9 +1426,14 @@ void Softmax::backward_impl(const vector<const Tensor*>& xs,
 #endif
 }
 
+// log partition function of each batch element, cached for backward
+size_t PickNegLogSoftmax::aux_storage_size() const {
+  return dim.batch_elems() * sizeof(float);
+}
+
 void PickNegLogSoftmax::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
   if (xs[0]->d.cols() == 1) {
-    logz = (float*)fxs->allocate(sizeof(float)*fx.d.batch_elems());
+    float* logz = static_cast<float*>(aux_mem);
 #if HAVE_CUDA
     if(pval) {
       gpu::pnlsoftmax(xs[0]->d.size(), *pval, xs[0]->v, fx.v, logz);
@@ -1419,6 +1470,7 @@ void PickNegLogSoftmax::backward_impl(const vector<const Tensor*>& xs,
                             unsigned i,
                             Tensor& dEdxi) const {
   if (xs[0]->d.cols() == 1) {
+    const float* logz = static_cast<const float*>(aux_mem);
 #if HAVE_CUDA
     if(pval) {
       const auto elem = *pval;
@@ -1539,6 +1591,34 @@ void RestrictedLogSoftmax::backward_impl(const vector<const Tensor*>& xs,
 #endif
 }
 
+void MaskedArgmax::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+#ifdef HAVE_CUDA
+  throw std::runtime_error("MaskedArgmax not yet implemented for CUDA");
+#else
+  assert(xs.size() == 1);
+  assert(mask.size() > 0);
+  const float* x = xs[0]->v;
+  unsigned best = mask.front();
+  for (auto i : mask)
+    if (x[i] > x[best]) best = i;
+  fx.v[0] = best;
+  fx.v[1] = x[best];
+#endif
+}
+
+void MaskedArgmax::backward_impl(const vector<const Tensor*>& xs,
+                            const Tensor& fx,
+                            const Tensor& dEdf,
+                            unsigned i,
+                            Tensor& dEdxi) const {
+  assert(i == 0);
+#ifdef HAVE_CUDA
+  throw std::runtime_error("MaskedArgmax not yet implemented for CUDA");
+#else
+  dEdxi.v[static_cast<unsigned>(fx.v[0])] += dEdf.v[1];
+#endif
+}
+
 // x_1 is a vector
 // y = (x_1)_{*pval}
 void PickElement::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
@@ -1898,6 +1978,158 @@ void AffineTransform::backward_impl(const vector<const Tensor*>& xs,
   }
 }
 
+// aux memory holds i_t, tanh of the cell candidate, o_t and tanh(c_t) from
+// forward, then the gradients of the three gate pre-activations and of c_t,
+// which backward_begin computes once per backward pass for the backward
+// calls of all the arguments. every block starts 32-byte aligned.
+static inline unsigned lstm_cell_block(unsigned n) { return (n + 7) & ~7u; }
+
+size_t LSTMCell::aux_size(const Dim& d) {
+  const unsigned HK = d.rows() / 2 * d.bd;
+  return 8 * lstm_cell_block(HK) * sizeof(float);
+}
+
+size_t LSTMCell::aux_storage_size() const {
+  return aux_size(dim);
+}
+
+void LSTMCell::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+  compute(xs.data(), xs.size(), step, static_cast<float*>(aux_mem), fx);
+}
+
+void LSTMCell::compute(const Tensor* const* xs, unsigned nargs, int step, float* aux, Tensor& fx) {
+#if HAVE_CUDA
+  throw std::runtime_error("LSTMCell not yet implemented for CUDA");
+#else
+  const unsigned H = fx.d.rows() / 2, K = fx.d.bd, S = lstm_cell_block(H * K);
+  const unsigned hp_i = step < 0 ? X + 1 : X + 3, cp_i = hp_i + 1;
+  const bool has_prev = nargs > hp_i;
+  Eigen::Map<Eigen::MatrixXf> it(aux, H, K), wt(aux + S, H, K), ot(aux + 2 * S, H, K), tct(aux + 3 * S, H, K);
+  auto y = fx.colbatch_matrix();
+  // the pre-activations are summed in the same order as affine_transform
+  // would, so the result matches the cell built from separate nodes
+  if (step < 0) {
+    const auto x = xs[X]->colbatch_matrix();
+    it.colwise() = xs[BI]->vec();
+    it.noalias() += **xs[X2I] * x;
+    wt.colwise() = xs[BC]->vec();
+    wt.noalias() += **xs[X2C] * x;
+  } else {
+    it = xs[X]->batch_matrix(step);
+    wt = xs[X + 1]->batch_matrix(step);
+  }
+  if (has_prev) {
+    const auto hp = xs[hp_i]->colbatch_matrix();
+    it.noalias() += **xs[H2I] * hp;
+    it.noalias() += **xs[C2I] * xs[cp_i]->colbatch_matrix();
+    wt.noalias() += **xs[H2C] * hp;
+  }
+  it = it.unaryExpr(scalar_logistic_sigmoid_op<float>());
+  wt = wt.array().tanh();
+  // c_t is kept in tct until the output gate has been computed
+  if (has_prev)
+    tct.array() = (1.f - it.array()) * xs[cp_i]->colbatch_matrix().array() + it.array() * wt.array();
+  else
+    tct = it.cwiseProduct(wt);
+  y.bottomRows(H) = tct;
+  if (step < 0) {
+    ot.colwise() = xs[BO]->vec();
+    ot.noalias() += **xs[X2O] * xs[X]->colbatch_matrix();
+  } else {
+    ot = xs[X + 2]->batch_matrix(step);
+  }
+  if (has_prev)
+    ot.noalias() += **xs[H2O] * xs[hp_i]->colbatch_matrix();
+  ot.noalias() += **xs[C2O] * tct;
+  ot = ot.unaryExpr(scalar_logistic_sigmoid_op<float>());
+  tct = tct.array().tanh();
+  y.topRows(H) = ot.cwiseProduct(tct);
+#endif
+}
+
+void LSTMCell::backward_begin(const vector<const Tensor*>& xs,
+                              const Tensor& fx,
+                              const Tensor& dEdf) const {
+#if HAVE_CUDA
+  throw std::runtime_error("LSTMCell not yet implemented for CUDA");
+#else
+  const unsigned H = fx.d.rows() / 2, K = fx.d.bd, S = lstm_cell_block(H * K);
+  const unsigned hp_i = hprev(), cp_i = hp_i + 1;
+  const bool has_prev = xs.size() > hp_i;
+  float* aux = static_cast<float*>(aux_mem);
+  const Eigen::Map<Eigen::MatrixXf> it(aux, H, K), wt(aux + S, H, K), ot(aux + 2 * S, H, K), tct(aux + 3 * S, H, K);
+  Eigen::Map<Eigen::MatrixXf> dai(aux + 4 * S, H, K), dac(aux + 5 * S, H, K), dao(aux + 6 * S, H, K), dct(aux + 7 * S, H, K);
+  const auto d = dEdf.colbatch_matrix();
+  dao.array() = d.topRows(H).array() * tct.array() * ot.array() * (1.f - ot.array());
+  dct = d.bottomRows(H);
+  dct.array() += d.topRows(H).array() * ot.array() * (1.f - tct.array().square());
+  dct.noalias() += (**xs[C2O]).transpose() * dao;
+  if (has_prev)
+    dai.array() = dct.array() * (wt.array() - xs[cp_i]->colbatch_matrix().array()) * it.array() * (1.f - it.array());
+  else
+    dai.array() = dct.array() * wt.array() * it.array() * (1.f - it.array());
+  dac.array() = dct.array() * it.array() * (1.f - wt.array().square());
+#endif
+}
+
+void LSTMCell::backward_impl(const vector<const Tensor*>& xs,
+                             const Tensor& fx,
+                             const Tensor& dEdf,
+                             unsigned i,
+                             Tensor& dEdxi) const {
+#if HAVE_CUDA
+  throw std::runtime_error("LSTMCell not yet implemented for CUDA");
+#else
+  const unsigned H = fx.d.rows() / 2, K = fx.d.bd, S = lstm_cell_block(H * K);
+  const unsigned hp_i = hprev(), cp_i = hp_i + 1;
+  const bool has_prev = xs.size() > hp_i;
+  // without a previous state, h_{t-1} and c_{t-1} are zero and so are the
+  // gradients of the parameters that multiply them. with projected inputs,
+  // the input weights and biases get theirs through the projections.
+  if (!has_prev && (i == H2I || i == C2I || i == H2O || i == H2C)) return;
+  if (step >= 0 && (i == X2I || i == BI || i == X2O || i == BO || i == X2C || i == BC)) return;
+  float* aux = static_cast<float*>(aux_mem);
+  const Eigen::Map<Eigen::MatrixXf> it(aux, H, K), wt(aux + S, H, K), ot(aux + 2 * S, H, K), tct(aux + 3 * S, H, K);
+  const Eigen::Map<Eigen::MatrixXf> dai(aux + 4 * S, H, K), dac(aux + 5 * S, H, K), dao(aux + 6 * S, H, K), dct(aux + 7 * S, H, K);
+  if (i >= X) {
+    if (step >= 0 && i < hp_i) {  // input projections
+      const Eigen::Map<Eigen::MatrixXf>& da = (i == X ? dai : (i == X + 1 ? dac : dao));
+      dEdxi.batch_matrix(step) += da;
+    } else if (i == X) {
+      auto dx = dEdxi.colbatch_matrix();
+      dx.noalias() += (**xs[X2I]).transpose() * dai;
+      dx.noalias() += (**xs[X2C]).transpose() * dac;
+      dx.noalias() += (**xs[X2O]).transpose() * dao;
+    } else if (i == hp_i) {
+      auto dh = dEdxi.colbatch_matrix();
+      dh.noalias() += (**xs[H2I]).transpose() * dai;
+      dh.noalias() += (**xs[H2C]).transpose() * dac;
+      dh.noalias() += (**xs[H2O]).transpose() * dao;
+    } else {
+      assert(i == cp_i);
+      auto dc = dEdxi.colbatch_matrix();
+      dc.array() += dct.array() * (1.f - it.array());
+      dc.noalias() += (**xs[C2I]).transpose() * dai;
+    }
+    return;
+  }
+  const auto x = xs[X]->colbatch_matrix();
+  switch (i) {
+    case X2I: (*dEdxi).noalias() += dai * x.transpose(); break;
+    case H2I: (*dEdxi).noalias() += dai * xs[hp_i]->colbatch_matrix().transpose(); break;
+    case C2I: (*dEdxi).noalias() += dai * xs[cp_i]->colbatch_matrix().transpose(); break;
+    case BI: dEdxi.vec() += dai.rowwise().sum(); break;
+    case X2O: (*dEdxi).noalias() += dao * x.transpose(); break;
+    case H2O: (*dEdxi).noalias() += dao * xs[hp_i]->colbatch_matrix().transpose(); break;
+    case C2O: (*dEdxi).noalias() += dao * fx.colbatch_matrix().bottomRows(H).transpose(); break;
+    case BO: dEdxi.vec() += dao.rowwise().sum(); break;
+    case X2C: (*dEdxi).noalias() += dac * x.transpose(); break;
+    case H2C: (*dEdxi).noalias() += dac * xs[hp_i]->colbatch_matrix().transpose(); break;
+    case BC: dEdxi.vec() += dac.rowwise().sum(); break;
+  }
+#endif
+}
+
 void Negate::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
   assert(xs.size() == 1);
 #if HAVE_CUDA
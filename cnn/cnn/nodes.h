@@ -474,6 +474,7 @@ struct Concatenate : public Node {
   template <typename T> explicit Concatenate(const T& a) : Node(a) {}
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool dim_is_cacheable() const override { return true; }
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
                   const Tensor& fx,
@@ -587,6 +588,7 @@ struct MatrixMultiply : public Node {
   explicit MatrixMultiply(const std::initializer_list<VariableIndex>& a) : Node(a) {}
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool dim_is_cacheable() const override { return true; }
   virtual bool supports_multibatch() const override { return true; }
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
@@ -601,6 +603,7 @@ struct CwiseMultiply : public Node {
   explicit CwiseMultiply(const std::initializer_list<VariableIndex>& a) : Node(a) {}
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool dim_is_cacheable() const override { return true; }
   virtual bool supports_multibatch() const override { return true; }
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
@@ -629,6 +632,7 @@ struct AffineTransform : public Node {
   template <typename T> explicit AffineTransform(const T& a) : Node(a) {}
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool dim_is_cacheable() const override { return true; }
   virtual bool supports_multibatch() const override { return true; }
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
@@ -638,6 +642,40 @@ struct AffineTransform : public Node {
                   Tensor& dEdxi) const override;
 };
 
+// one step of the LSTMBuilder cell, with all gates computed in a single node
+// x_1 .. x_11 = W_xi, W_hi, W_ci, b_i, W_xo, W_ho, W_co, b_o, W_xc, W_hc, b_c
+// x_12 = input, x_13 = h_{t-1}, x_14 = c_{t-1} (x_13 and x_14 may be omitted)
+// y = [h_t; c_t]
+// if step >= 0, x_12 .. x_14 are instead W_xi x + b_i, W_xc x + b_c and
+// W_xo x + b_o for every timestep of a sequence, one batch element each,
+// and the cell computes timestep step; h_{t-1} and c_{t-1} follow them
+struct LSTMCell : public Node {
+  enum { X2I, H2I, C2I, BI, X2O, H2O, C2O, BO, X2C, H2C, BC, X };
+  template <typename T> explicit LSTMCell(const T& a, int step = -1) : Node(a), step(step) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool supports_multibatch() const override { return true; }
+  size_t aux_storage_size() const override;
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                  const Tensor& fx,
+                  const Tensor& dEdf,
+                  unsigned i,
+                  Tensor& dEdxi) const override;
+  // computes the gradients of the gate pre-activations, which those of all
+  // the arguments are taken from
+  void backward_begin(const std::vector<const Tensor*>& xs,
+                      const Tensor& fx,
+                      const Tensor& dEdf) const override;
+  // index of h_{t-1}, which is followed by c_{t-1}
+  unsigned hprev() const { return step < 0 ? X + 1 : X + 3; }
+  // forward on tensors outside of a graph, for graph-free inference; aux
+  // must be 32-byte aligned and hold aux_size(fx.d) bytes
+  static void compute(const Tensor* const* xs, unsigned nargs, int step, float* aux, Tensor& fx);
+  static size_t aux_size(const Dim& d);
+  int step;
+};
+
 // y = -x_1
 struct Negate : public Node {
   explicit Negate(const std::initializer_list<VariableIndex>& a) : Node(a) {}
@@ -716,6 +754,7 @@ struct Sum : public Node {
   template <typename T> explicit Sum(const T& a) : Node(a) {}
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool dim_is_cacheable() const override { return true; }
   // TODO: Sum should be be implemented over the entire mini-batch, but this is not
   //       super-easy in the current implementation
   // virtual bool supports_multibatch() const override { return true; }
@@ -741,6 +780,38 @@ struct SumBatches : public Node {
                     Tensor& dEdxi) const override;
 };
 
+// y = [x_1 ... x_n], stacked along the batch dimension
+// each x_i may itself contain several batch elements
+struct ConcatenateToBatch : public Node {
+  template <typename T> explicit ConcatenateToBatch(const T& a) : Node(a) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool dim_is_cacheable() const override { return true; }
+  virtual bool supports_multibatch() const override { return true; }
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                    const Tensor& fx,
+                    const Tensor& dEdf,
+                    unsigned i,
+                    Tensor& dEdxi) const override;
+};
+
+// y = the index-th batch element of x_1
+// forward is O(1) since the result points into x_1
+struct PickBatchElement : public Node {
+  explicit PickBatchElement(const std::initializer_list<VariableIndex>& a, unsigned b) : Node(a), index(b) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool supports_multibatch() const override { return true; }
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                    const Tensor& fx,
+                    const Tensor& dEdf,
+                    unsigned i,
+                    Tensor& dEdxi) const override;
+  unsigned index;
+};
+
 // y = ( \sum_i x_i ) / |x|
 struct Average : public Node {
   template <typename T> explicit Average(const T& a) : Node(a) {}
@@ -900,13 +971,13 @@ struct PickNegLogSoftmax : public Node {
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
   virtual bool supports_multibatch() const override { return true; }
+  size_t aux_storage_size() const override;
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
                     const Tensor& fx,
                     const Tensor& dEdf,
                     unsigned i,
                     Tensor& dEdxi) const override;
-  mutable float* logz;
   unsigned val;
   const unsigned* pval;
   std::vector<unsigned> vals;
@@ -928,6 +999,23 @@ struct RestrictedLogSoftmax : public Node {
   std::vector<unsigned> denom;
 };
 
+// x_1 is a vector
+// y = [i, (x_1)_i] where i is the argmax of x_1 over the indices in mask,
+// ties going to the index that comes first in mask. the index is stored as
+// a float, and only the score passes gradients back to x_1
+struct MaskedArgmax : public Node {
+  explicit MaskedArgmax(const std::initializer_list<VariableIndex>& a, const std::vector<unsigned>& m) : Node(a), mask(m) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                    const Tensor& fx,
+                    const Tensor& dEdf,
+                    unsigned i,
+                    Tensor& dEdxi) const override;
+  std::vector<unsigned> mask;
+};
+
 // x_1 is a vector
 // y = (x_1)_{*pval}
 // this is used to implement cross-entropy training
@@ -87,6 +87,40 @@ Expression SimpleRNNBuilder::add_input_impl(int prev, const Expression &in) {
   return h[t].back();
 }
 
+// x2h * x + hb is computed for all the steps of a layer as a single GEMM,
+// with the steps stacked along the batch dimension
+vector<Expression> SimpleRNNBuilder::add_inputs_impl(int prev, const vector<Expression>& xs) {
+  const unsigned n = xs.size();
+  if (n < 2) return RNNBuilder::add_inputs_impl(prev, xs);
+  const unsigned first = h.size();
+  for (unsigned t = 0; t < n; ++t)
+    h.push_back(vector<Expression>(layers));
+
+  vector<Expression> x = xs;
+
+  for (unsigned i = 0; i < layers; ++i) {
+    const vector<Expression>& vars = param_vars[i];
+
+    // y <--- f(x), for every step
+    Expression ys = affine_transform({vars[HB], vars[X2H], concatenate_to_batch(x)});
+
+    for (unsigned t = 0; t < n; ++t) {
+      Expression y = pick_batch_elem(ys, t);
+      const int p = t ? first + t - 1 : prev;
+
+      // y <--- g(y_prev)
+      if (p == -1 && h0.size() > 0)
+        y = affine_transform({y, vars[H2H], h0[i]});
+      else if (p >= 0)
+        y = affine_transform({y, vars[H2H], h[p][i]});
+
+      // x <--- tanh(y)
+      x[t] = h[first + t][i] = tanh(y);
+    }
+  }
+  return x;
+}
+
 Expression SimpleRNNBuilder::add_auxiliary_input(const Expression &in, const Expression &aux) {
   const unsigned t = h.size();
   h.push_back(vector<Expression>(layers));
@@ -61,6 +61,43 @@ struct RNNBuilder {
     return add_input_impl(prev, x);
   }
 
+  // add one timestep to each of several sequences at once: xs[k] extends
+  // the state prev[k]. returns the new state of each sequence, in order,
+  // which can be read back with get_h / get_s or passed as prev again.
+  // builders that can run the steps as a single minibatch override
+  // add_input_batch_impl; the results are the same as calling add_input
+  // once per sequence.
+  std::vector<RNNPointer> add_input_batch(const std::vector<RNNPointer>& prev,
+                                          const std::vector<Expression>& xs) {
+    assert(prev.size() == xs.size());
+    sm.transition(RNNOp::add_input);
+    std::vector<RNNPointer> ret(prev.size());
+    for (unsigned k = 0; k < prev.size(); ++k) {
+      head.push_back(prev[k]);
+      ret[k] = RNNPointer(head.size() - 1);
+    }
+    if (ret.size()) cur = ret.back();
+    add_input_batch_impl(prev, xs);
+    return ret;
+  }
+
+  // add a whole sequence of timesteps after the current state, as if
+  // add_input were called on each x in turn, and return the output of every
+  // step. builders override add_inputs_impl to compute the input
+  // projections of all the steps at once, one layer at a time.
+  std::vector<Expression> add_inputs(const std::vector<Expression>& xs) {
+    sm.transition(RNNOp::add_input);
+    const RNNPointer prev = cur;
+    for (unsigned t = 0; t < xs.size(); ++t) {
+      head.push_back(cur);
+      cur = head.size() - 1;
+    }
+    return add_inputs_impl(prev, xs);
+  }
+
+  // the state that state i was built on
+  RNNPointer get_head(const RNNPointer& i) const { return head[i]; }
+
   // rewind the last timestep - this DOES NOT remove the variables
   // from the computation graph, it just means the next time step will
   // see a different previous state. You can remind as many times as
@@ -85,6 +122,19 @@ struct RNNBuilder {
   virtual void new_graph_impl(ComputationGraph& cg) = 0;
   virtual void start_new_sequence_impl(const std::vector<Expression>& h_0) = 0;
   virtual Expression add_input_impl(int prev, const Expression& x) = 0;
+  virtual void add_input_batch_impl(const std::vector<RNNPointer>& prev,
+                                    const std::vector<Expression>& xs) {
+    for (unsigned k = 0; k < prev.size(); ++k)
+      add_input_impl(prev[k], xs[k]);
+  }
+  // the new states are the last xs.size() ones, each built on the one before
+  virtual std::vector<Expression> add_inputs_impl(int prev, const std::vector<Expression>& xs) {
+    std::vector<Expression> ys(xs.size());
+    const int first = head.size() - xs.size();
+    for (unsigned t = 0; t < xs.size(); ++t)
+      ys[t] = add_input_impl(t ? first + t - 1 : prev, xs[t]);
+    return ys;
+  }
   RNNPointer cur;
  private:
   // the state machine ensures that the caller is behaving
@@ -104,6 +154,7 @@ struct SimpleRNNBuilder : public RNNBuilder {
   void new_graph_impl(ComputationGraph& cg) override;
   void start_new_sequence_impl(const std::vector<Expression>& h_0) override;
   Expression add_input_impl(int prev, const Expression& x) override;
+  std::vector<Expression> add_inputs_impl(int prev, const std::vector<Expression>& xs) override;
 
  public:
   Expression add_auxiliary_input(const Expression& x, const Expression &aux);
@@ -13,11 +13,11 @@ ShadowParameters::ShadowParameters(const Parameters& p) : h(p.values) {
   TensorTools::Zero(h);
 }
 
-ShadowLookupParameters::ShadowLookupParameters(const LookupParameters& lp) : h(lp.values) {
-  for (auto& t : h) {
-    t.v = (float*)default_device->mem->malloc(t.d.size() * sizeof(float));
-    TensorTools::Zero(t);
-  }
+ShadowLookupParameters::ShadowLookupParameters(const LookupParameters& lp) : all_h(lp.all_values), h(lp.values) {
+  all_h.v = (float*)default_device->mem->malloc(all_h.d.size() * sizeof(float));
+  TensorTools::Zero(all_h);
+  for (unsigned i = 0; i < h.size(); ++i)
+    h[i].v = all_h.v + i * lp.stride;
 }
 
 vector<ShadowParameters> AllocateShadowParameters(const Model& m) {
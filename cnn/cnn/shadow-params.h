@@ -19,8 +19,11 @@ struct ShadowParameters {
   Tensor h;
 };
 
+// laid out like the rows of the LookupParameters: all_h holds them all and
+// h has a view of each
 struct ShadowLookupParameters {
   explicit ShadowLookupParameters(const LookupParameters& lp);
+  Tensor all_h;
   std::vector<Tensor> h;
 };
 
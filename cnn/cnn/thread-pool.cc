@@ -0,0 +1,61 @@
+#include "cnn/thread-pool.h"
+
+using namespace std;
+
+namespace cnn {
+
+ThreadPool::ThreadPool(unsigned threads) :
+    task(nullptr), num_tasks(0), next_task(0), busy(0), generation(0), stop(false) {
+  for (unsigned t = 1; t < threads; ++t)
+    workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(m);
+    stop = true;
+  }
+  start.notify_all();
+  for (auto& w : workers) w.join();
+}
+
+void ThreadPool::run(unsigned n, const function<void(unsigned)>& f) {
+  if (workers.empty() || n < 2) {
+    for (unsigned i = 0; i < n; ++i) f(i);
+    return;
+  }
+  {
+    lock_guard<mutex> lock(m);
+    task = &f;
+    num_tasks = n;
+    next_task = 0;
+    busy = workers.size();
+    ++generation;
+  }
+  start.notify_all();
+  run_tasks();
+  unique_lock<mutex> lock(m);
+  done.wait(lock, [this] { return busy == 0; });
+}
+
+void ThreadPool::run_tasks() {
+  for (unsigned i; (i = next_task++) < num_tasks; )
+    (*task)(i);
+}
+
+void ThreadPool::work() {
+  unsigned seen = 0;
+  while (true) {
+    {
+      unique_lock<mutex> lock(m);
+      start.wait(lock, [&] { return stop || generation != seen; });
+      if (stop) return;
+      seen = generation;
+    }
+    run_tasks();
+    lock_guard<mutex> lock(m);
+    if (--busy == 0) done.notify_one();
+  }
+}
+
+} // namespace cnn
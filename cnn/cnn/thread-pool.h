@@ -0,0 +1,49 @@
+#ifndef CNN_THREAD_POOL_H
+#define CNN_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cnn {
+
+// a fixed set of threads that run the tasks of one parallel loop at a time.
+// the threads are started once, so that a loop as short as a parameter
+// update does not pay for creating them.
+class ThreadPool {
+ public:
+  // the calling thread of run() is one of the threads
+  explicit ThreadPool(unsigned threads);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  unsigned size() const { return workers.size() + 1; }
+  // runs f(0), ..., f(n - 1) and returns when they are all done. the tasks
+  // are handed out in order to whichever thread is free, so anything that
+  // must not depend on the number of threads (such as the order of a sum)
+  // should be written to per-task slots and combined afterwards
+  void run(unsigned n, const std::function<void(unsigned)>& f);
+
+ private:
+  void work();
+  void run_tasks();
+
+  std::vector<std::thread> workers;
+  std::mutex m;
+  std::condition_variable start;
+  std::condition_variable done;
+  const std::function<void(unsigned)>* task;
+  unsigned num_tasks;
+  std::atomic<unsigned> next_task;
+  unsigned busy;  // workers still running tasks of the current loop
+  unsigned generation;  // number of loops started
+  bool stop;
+};
+
+} // namespace cnn
+
+#endif
@@ -1,7 +1,15 @@
 #include "cnn/training.h"
 
+#include <numeric>
+
+#include "cnn/cnn.h"
+#include "cnn/param-nodes.h"
 #include "cnn/gpu-ops.h"
 
+#if HAVE_CUDA
+#include "cnn/cuda.h"
+#endif
+
 namespace cnn {
 
 using namespace std;
@@ -11,12 +19,185 @@ bool is_valid(const Eigen::MatrixBase<Derived>& x) {
   return ((x - x).array() == (x - x).array()).all();
 }
 
+// the update of each trainer is a single loop over the elements of a
+// parameter (or of a lookup row) that reads the value, the gradient and the
+// trainer's state once and writes each of them once
+namespace {
+
+// x -= c * g + lambda * x
+void sgd_kernel(unsigned n, float* x, const float* g, float c, float lambda) {
+  for (unsigned i = 0; i < n; ++i)
+    x[i] -= c * g[i] + x[i] * lambda;
+}
+
+void momentum_kernel(unsigned n, float* x, const float* g, float* v,
+                     float momentum, float c, float lambda) {
+  for (unsigned i = 0; i < n; ++i) {
+    const float vi = momentum * v[i] - c * g[i];
+    v[i] = vi;
+    x[i] += vi - x[i] * lambda;
+  }
+}
+
+void adagrad_kernel(unsigned n, float* x, const float* g, float* v,
+                    float s, float eta, float epsilon, float lambda) {
+  for (unsigned i = 0; i < n; ++i) {
+    const float gi = s * g[i];
+    const float vi = v[i] + gi * gi;
+    v[i] = vi;
+    x[i] += -eta * (gi / sqrt(vi + epsilon)) - x[i] * lambda;
+  }
+}
+
+void adadelta_kernel(unsigned n, float* x, const float* g, float* hg, float* hd,
+                     float s, float rho, float epsilon, float lambda) {
+  for (unsigned i = 0; i < n; ++i) {
+    const float gi = s * g[i];
+    const float hgi = rho * hg[i] + (1 - rho) * (gi * gi);
+    hg[i] = hgi;
+    const float delta = (-gi * sqrt(hd[i] + epsilon)) / sqrt(hgi + epsilon);
+    hd[i] = rho * hd[i] + (1 - rho) * (delta * delta);
+    x[i] += delta - x[i] * lambda;
+  }
+}
+
+void adam_kernel(unsigned n, float* x, const float* g, float* m, float* v, float s,
+                 float beta_1, float beta_2, float s1, float s2, float eta, float eps, float lambda) {
+  for (unsigned i = 0; i < n; ++i) {
+    const float gi = s * g[i];
+    const float mi = beta_1 * m[i] + (1 - beta_1) * gi;
+    const float vi = beta_2 * v[i] + (1 - beta_2) * (gi * gi);
+    m[i] = mi;
+    v[i] = vi;
+    x[i] += (-eta * (mi / s1)) / (sqrt(vi / s2) + eps) - x[i] * lambda;
+  }
+}
+
+// elements of a parameter, and touched rows of a lookup parameter, updated
+// by one task of Trainer::parallel_update
+constexpr unsigned kElementsPerTask = 1 << 15;
+constexpr unsigned kRowsPerTask = 256;
+
+} // namespace
+
+LocalGradients::LocalGradients(const Model& m) :
+    model(&m), p(AllocateShadowParameters(m)), lp(AllocateShadowLookupParameters(m)) {
+#if HAVE_CUDA
+  throw std::runtime_error("LocalGradients are not supported with CUDA");
+#endif
+  for (unsigned i = 0; i < m.parameters_list().size(); ++i)
+    p_index[m.parameters_list()[i]] = i;
+  for (unsigned i = 0; i < m.lookup_parameters_list().size(); ++i) {
+    lp_index[m.lookup_parameters_list()[i]] = i;
+    lp_rows.emplace_back(m.lookup_parameters_list()[i]->values.size());
+  }
+}
+
+void LocalGradients::add(const ComputationGraph& cg) {
+  for (VariableIndex i : cg.parameter_nodes) {
+    const Tensor& g = cg.get_gradient(i);
+    const Node* node = cg.nodes[i];
+    if (auto pn = dynamic_cast<const ParameterNode*>(node)) {
+      p[p_index.at(pn->params)].h.vec() += g.vec();
+    } else if (auto ln = dynamic_cast<const LookupNode*>(node)) {
+      const unsigned k = lp_index.at(ln->params);
+      auto add_row = [&](unsigned row, const Tensor& gr) {
+        lp_rows[k].insert(row);
+        lp[k].h[row].vec() += gr.vec();
+      };
+      if (ln->pindex) {
+        add_row(*ln->pindex, g);
+      } else {
+        const vector<Tensor>& gb = g.batch_elems();
+        for (unsigned b = 0; b < ln->pindices->size(); ++b)
+          add_row(ln->pindices->at(b), gb[b]);
+      }
+    } else {
+      throw std::runtime_error("LocalGradients::add: unknown parameter node");
+    }
+  }
+}
+
+float LocalGradients::squared_l2norm() const {
+  float a = 0;
+  for (auto& sp : p)
+    a += sp.h.vec().squaredNorm();
+  for (unsigned k = 0; k < lp.size(); ++k)
+    for (auto i : lp_rows[k].rows())
+      a += lp[k].h[i].vec().squaredNorm();
+  return a;
+}
+
+void LocalGradients::accumulate_into_model(real scale) const {
+  for (unsigned k = 0; k < p.size(); ++k)
+    model->parameters_list()[k]->g.vec() += scale * p[k].h.vec();
+  for (unsigned k = 0; k < lp.size(); ++k) {
+    LookupParameters* l = model->lookup_parameters_list()[k];
+    for (auto i : lp_rows[k].rows()) {
+      l->non_zero_grads.insert(i);
+      l->grads[i].vec() += scale * lp[k].h[i].vec();
+    }
+  }
+}
+
+void LocalGradients::clear() {
+  for (auto& sp : p)
+    TensorTools::Zero(sp.h);
+  for (unsigned k = 0; k < lp.size(); ++k) {
+    for (auto i : lp_rows[k].rows())
+      TensorTools::Zero(lp[k].h[i]);
+    lp_rows[k].clear();
+  }
+}
+
 Trainer::~Trainer() {}
 
+vector<atomic<int>>& Trainer::track(LookupParameters* p, unsigned t) {
+  vector<atomic<int>>& last = last_update[p];
+  vector<atomic<int>>(p->values.size()).swap(last);
+  for (auto& l : last) l = (int)t - 1;
+  return last;
+}
+
+void Trainer::catch_up(LookupParameters* p, vector<atomic<int>>& last,
+                       const unsigned* rows, unsigned n, unsigned t) {
+  if (lambda == 0) return;
+  if (last.empty()) return;  // exempt
+  for (unsigned r = 0; r < n; ++r) {
+    const unsigned i = rows[r];
+    // Hogwild updates can catch up the same row at once; only the one that
+    // moves last[i] forward applies the decay it owes, so that decay is
+    // never applied twice. an update that gets there after a later one
+    // still decays the row by its own step, one step too many: a race of
+    // the same size as those of the unlocked Hogwild writes
+    int l = last[i];
+    while (l < (int)t && !last[i].compare_exchange_weak(l, t)) {}
+    if ((int)t - 1 > l) {
+      const float decay = pow(1 - lambda, (int)t - 1 - l);
+#if HAVE_CUDA
+      CUBLAS_CHECK(cublasSscal(cublas_handle, p->values[i].d.size(), &decay, p->values[i].v, 1));
+#else
+      p->values[i].vec() *= decay;
+#endif
+    }
+  }
+}
+
+void Trainer::flush_regularization() {
+  const unsigned t = steps;
+  for (auto& pl : last_update) {
+    vector<unsigned> rows(pl.second.size());
+    iota(rows.begin(), rows.end(), 0);
+    // as if update t were about to touch every row, without its own decay
+    catch_up(pl.first, pl.second, rows.data(), rows.size(), t);
+    for (auto& l : pl.second) l = (int)t - 1;
+  }
+}
+
 float Trainer::clip_gradients() {
   float gscale = 1;
   if (clipping_enabled) {
-    float gg = model->gradient_l2_norm();
+    float gg = model->gradient_l2_norm(pool.get());
     if (isnan(gg) || isinf(gg)) {
       cerr << "Magnitude of gradient is bad: " << gg << endl;
       abort();
@@ -29,33 +210,122 @@ float Trainer::clip_gradients() {
   return gscale;
 }
 
+void Trainer::parallel_update(const vector<Parameters*>& params,
+                              const vector<LookupParameters*>& lookup_params, unsigned t,
+                              const function<void(unsigned, unsigned, unsigned)>& dense,
+                              const function<void(unsigned, const unsigned*, unsigned)>& sparse) {
+  // a range of the elements of params[k] if rows is null, of the touched
+  // rows of lookup_params[k] otherwise
+  struct Task {
+    unsigned k;
+    const unsigned* rows;
+    unsigned begin, end;
+  };
+  vector<Task> tasks;
+  for (unsigned k = 0; k < params.size(); ++k) {
+    const unsigned n = params[k]->values.d.size();
+    for (unsigned b = 0; b < n; b += kElementsPerTask)
+      tasks.push_back({k, nullptr, b, min(n, b + kElementsPerTask)});
+  }
+  vector<vector<atomic<int>>*> last(lookup_params.size());
+  for (unsigned k = 0; k < lookup_params.size(); ++k) {
+    LookupParameters* p = lookup_params[k];
+    // the touched rows are sorted, and the map filled in, before any task
+    // can read them
+    const vector<unsigned>& rows = p->touched_rows();
+    auto it = last_update.find(p);
+    last[k] = it != last_update.end() ? &it->second : &track(p, t);
+    for (unsigned b = 0; b < rows.size(); b += kRowsPerTask)
+      tasks.push_back({k, rows.data(), b, min((unsigned)rows.size(), b + kRowsPerTask)});
+  }
+  auto run = [&](unsigned i) {
+    const Task& task = tasks[i];
+    if (!task.rows) {
+      dense(task.k, task.begin, task.end);
+      Tensor g(Dim({task.end - task.begin}), params[task.k]->g.v + task.begin);
+      TensorTools::Zero(g);
+    } else {
+      LookupParameters* p = lookup_params[task.k];
+      const unsigned* rows = task.rows + task.begin;
+      const unsigned n = task.end - task.begin;
+      catch_up(p, *last[task.k], rows, n, t);
+      sparse(task.k, rows, n);
+      for (unsigned r = 0; r < n; ++r)
+        TensorTools::Zero(p->grads[rows[r]]);
+    }
+  };
+  if (pool) {
+    pool->run(tasks.size(), run);
+  } else {
+    for (unsigned i = 0; i < tasks.size(); ++i) run(i);
+  }
+  for (auto p : lookup_params)
+    p->non_zero_grads.clear();
+}
+
 void SimpleSGDTrainer::update(real scale) {
     update(model->lookup_parameters_list(), model->parameters_list(), scale);
 }
 
 void SimpleSGDTrainer::update(const std::vector<LookupParameters*> &lookup_params, const std::vector<Parameters*> &params, real scale) {
+  const unsigned step = steps++;
   const float gscale = clip_gradients();
-  for (auto p : params) {
+  const float c = eta * scale * gscale;
+  parallel_update(params, lookup_params, step,
+    [&](unsigned k, unsigned begin, unsigned end) {
+      Parameters* p = params[k];
 #if HAVE_CUDA
-    gpu::sgd_update(p->values.d.size(), p->g.v, p->values.v, eta * scale * gscale, lambda);
+      gpu::sgd_update(end - begin, p->g.v + begin, p->values.v + begin, c, lambda);
 #else
-    auto reg = (p->values.vec()) * lambda;
-    p->values.vec() -= ((eta * scale * gscale) * p->g.vec() + reg);
+      sgd_kernel(end - begin, p->values.v + begin, p->g.v + begin, c, lambda);
 #endif
-    p->clear();
-  }
-  for (auto p : lookup_params) {
-    for (auto i : p->non_zero_grads) {
+    },
+    [&](unsigned k, const unsigned* rows, unsigned n) {
+      LookupParameters* p = lookup_params[k];
+      for (unsigned r = 0; r < n; ++r) {
+        const unsigned i = rows[r];
 #if HAVE_CUDA
-      gpu::sgd_update(p->values[i].d.size(), p->grads[i].v, p->values[i].v, eta * scale * gscale, lambda);
+        gpu::sgd_update(p->values[i].d.size(), p->grads[i].v, p->values[i].v, c, lambda);
 #else
-      auto reg = (p->values[i].vec()) * lambda;
-      p->values[i].vec() -= (p->grads[i].vec() * (eta * scale * gscale) + reg);
+        sgd_kernel(p->dim.size(), p->values[i].v, p->grads[i].v, c, lambda);
 #endif
+      }
+    });
+  ++updates;
+}
+
+bool SimpleSGDTrainer::hogwild_update(const LocalGradients& grads, real scale) {
+  const unsigned step = steps++;
+  float gscale = 1;
+  if (clipping_enabled) {
+    float gg = sqrt(grads.squared_l2norm());
+    if (isnan(gg) || isinf(gg)) {
+      cerr << "Magnitude of gradient is bad: " << gg << endl;
+      abort();
+    }
+    if (gg > clip_threshold)
+      gscale = clip_threshold / gg;
+  }
+  const auto& params = model->parameters_list();
+  for (unsigned k = 0; k < params.size(); ++k)
+    sgd_kernel(params[k]->values.d.size(), params[k]->values.v, grads.p[k].h.v, eta * scale * gscale, lambda);
+  const auto& lookup_params = model->lookup_parameters_list();
+  vector<vector<atomic<int>>*> last(lookup_params.size());
+  {
+    lock_guard<mutex> lock(last_update_mutex);
+    for (unsigned k = 0; k < lookup_params.size(); ++k) {
+      auto it = last_update.find(lookup_params[k]);
+      last[k] = it != last_update.end() ? &it->second : &track(lookup_params[k], step);
     }
-    p->clear();
   }
-  ++updates;
+  for (unsigned k = 0; k < lookup_params.size(); ++k) {
+    const vector<unsigned>& rows = grads.lp_rows[k].rows();
+    catch_up(lookup_params[k], *last[k], rows.data(), rows.size(), step);
+    for (auto i : rows)
+      sgd_kernel(lookup_params[k]->dim.size(), lookup_params[k]->values[i].v, grads.lp[k].h[i].v,
+                 eta * scale * gscale, lambda);
+  }
+  return gscale != 1;
 }
 
 void MomentumSGDTrainer::update(real scale) {
@@ -67,70 +337,57 @@ void MomentumSGDTrainer::update(real scale) {
     velocity_allocated = true;
   }
 
+  const unsigned step = steps++;
   const float gscale = clip_gradients();
-  unsigned pi = 0;
-  for (auto p : model->parameters_list()) {
-    Tensor& v = vp[pi++].h;
-    auto reg = p->values.vec() * lambda;
-    v.vec() = momentum * v.vec() - (eta * scale * gscale) * (p->g.vec());
-    p->values.vec() += v.vec() - reg;
-    p->clear();
-  }
-  pi = 0;
-  for (auto p : model->lookup_parameters_list()) {
-    vector<Tensor>& vx = vlp[pi++].h;
-    for (auto i : p->non_zero_grads) {
-      Tensor& v = vx[i];
-      auto reg = (p->values[i].vec()) * lambda;
-      v.vec() = momentum * v.vec() - (eta * scale * gscale) * (p->grads[i].vec());
-      p->values[i].vec() += v.vec() - reg;
-    }
-    p->clear();
-  }
+  const float c = eta * scale * gscale;
+  const auto& params = model->parameters_list();
+  const auto& lookup_params = model->lookup_parameters_list();
+  parallel_update(params, lookup_params, step,
+    [&](unsigned k, unsigned begin, unsigned end) {
+      Parameters* p = params[k];
+      momentum_kernel(end - begin, p->values.v + begin, p->g.v + begin, vp[k].h.v + begin, momentum, c, lambda);
+    },
+    [&](unsigned k, const unsigned* rows, unsigned n) {
+      LookupParameters* p = lookup_params[k];
+      const vector<Tensor>& vx = vlp[k].h;
+      for (unsigned r = 0; r < n; ++r) {
+        const unsigned i = rows[r];
+        momentum_kernel(p->dim.size(), p->values[i].v, p->grads[i].v, vx[i].v, momentum, c, lambda);
+      }
+    });
   ++updates;
 }
 
 void AdagradTrainer::update(real scale) {
-  unsigned pi;
   if (!shadow_params_allocated) {
     vp = AllocateShadowParameters(*model);
     vlp = AllocateShadowLookupParameters(*model);
     shadow_params_allocated = true;
   }
 
-  pi = 0;
+  const unsigned step = steps++;
   const float gscale = clip_gradients();
-  for (auto p : model->parameters_list()) {
-    Tensor& v = vp[pi++].h;
-    auto reg = p->values.vec() * lambda;
-    auto g = scale * gscale * p->g.vec();
-    auto g2 = g.cwiseProduct(g);
-    v.vec() += g2;
-    auto delta = -eta * g.cwiseQuotient((v.vec().array() + epsilon).matrix().cwiseSqrt());
-    p->values.vec() += delta - reg;
-    p->clear();
-  }
-
-  pi = 0;
-  for (auto p : model->lookup_parameters_list()) {
-    vector<Tensor>& vx = vlp[pi++].h;
-    for (auto i : p->non_zero_grads) {
-      Tensor& v = vx[i];
-      auto reg = p->values[i].vec() * lambda;
-      auto g = scale * gscale * p->grads[i].vec();
-      auto g2 = g.cwiseProduct(g);
-      v.vec() += g2;
-      auto delta = -eta * g.cwiseQuotient((v.vec().array() + epsilon).matrix().cwiseSqrt());
-      p->values[i].vec() += delta - reg;
-    }
-    p->clear();
-  }
+  const auto& params = model->parameters_list();
+  const auto& lookup_params = model->lookup_parameters_list();
+  parallel_update(params, lookup_params, step,
+    [&](unsigned k, unsigned begin, unsigned end) {
+      Parameters* p = params[k];
+      adagrad_kernel(end - begin, p->values.v + begin, p->g.v + begin, vp[k].h.v + begin,
+                     scale * gscale, eta, epsilon, lambda);
+    },
+    [&](unsigned k, const unsigned* rows, unsigned n) {
+      LookupParameters* p = lookup_params[k];
+      const vector<Tensor>& vx = vlp[k].h;
+      for (unsigned r = 0; r < n; ++r) {
+        const unsigned i = rows[r];
+        adagrad_kernel(p->dim.size(), p->values[i].v, p->grads[i].v, vx[i].v, scale * gscale, eta, epsilon, lambda);
+      }
+    });
 
   ++updates;
 }
 
 void AdadeltaTrainer::update(real scale) {
-  unsigned pi;
   if (!shadow_params_allocated) {
     hg = AllocateShadowParameters(*model);
     hlg = AllocateShadowLookupParameters(*model);
@@ -158,46 +415,26 @@ void AdadeltaTrainer::update(real scale) {
     shadow_params_allocated = true;
   }
 
+  const unsigned step = steps++;
   const float gscale = clip_gradients();
-  pi = 0;
-  for (auto p : model->parameters_list()) {
-    auto& g = (scale * gscale) * p->g.vec();
-    Tensor& hgv = hg[pi].h;
-    Tensor& hdv = hd[pi].h;
-    auto reg = p->values.vec() * lambda;
-    auto g2 = g.cwiseProduct(g);
-    hgv.vec() = rho * hgv.vec() + (1.0 - rho) * g2;
-    auto num = -g.cwiseProduct((hdv.vec().array() + epsilon).matrix().cwiseSqrt());
-    auto den = (hgv.vec().array() + epsilon).matrix().cwiseSqrt();
-    auto delta = num.cwiseQuotient(den);
-    auto d2 = delta.cwiseProduct(delta);
-    hdv.vec() = rho * hdv.vec() + (1.0 - rho) * d2;
-    p->values.vec() += delta - reg;
-    p->clear();
-    pi++;
-  }
-
-  pi = 0;
-  for (auto p : model->lookup_parameters_list()) {
-    vector<Tensor>& hgvx = hlg[pi].h;
-    vector<Tensor>& hdvx = hld[pi].h;
-    for (auto i : p->non_zero_grads) {
-      Tensor& hgv = hgvx[i];
-      Tensor& hdv = hdvx[i];
-      auto& g = scale * gscale * p->grads[i].vec();
-      auto reg = p->values[i].vec() * lambda;
-      auto g2 = g.cwiseProduct(g);
-      hgv.vec() = rho * hgv.vec() + (1.0 - rho) * g2;
-      auto num = -g.cwiseProduct((hdv.vec().array() + epsilon).matrix().cwiseSqrt());
-      auto den = (hgv.vec().array() + epsilon).matrix().cwiseSqrt();
-      auto delta = num.cwiseQuotient(den);
-      auto d2 = delta.cwiseProduct(delta);
-      hdv.vec() = rho * hdv.vec() + (1.0 - rho) * d2;
-      p->values[i].vec() += delta - reg;
-    }
-    p->clear();
-    pi++;
-  }
+  const auto& params = model->parameters_list();
+  const auto& lookup_params = model->lookup_parameters_list();
+  parallel_update(params, lookup_params, step,
+    [&](unsigned k, unsigned begin, unsigned end) {
+      Parameters* p = params[k];
+      adadelta_kernel(end - begin, p->values.v + begin, p->g.v + begin, hg[k].h.v + begin, hd[k].h.v + begin,
+                      scale * gscale, rho, epsilon, lambda);
+    },
+    [&](unsigned k, const unsigned* rows, unsigned n) {
+      LookupParameters* p = lookup_params[k];
+      const vector<Tensor>& hgvx = hlg[k].h;
+      const vector<Tensor>& hdvx = hld[k].h;
+      for (unsigned r = 0; r < n; ++r) {
+        const unsigned i = rows[r];
+        adadelta_kernel(p->dim.size(), p->values[i].v, p->grads[i].v, hgvx[i].v, hdvx[i].v,
+                        scale * gscale, rho, epsilon, lambda);
+      }
+    });
   ++updates;
 }
 
@@ -215,34 +452,36 @@ void RmsPropTrainer::update(real scale) {
     shadow_params_allocated = true;
   }
 
+  const unsigned step = steps++;
   const float gscale = clip_gradients();
-  pi = 0;
-  for (auto p : model->parameters_list()) {
-    real& d2 = hg[pi++];
-    auto reg = p->values.vec() * lambda;
-    real g2 = p->g.vec().squaredNorm();
-    d2 = rho * d2 + (1.0 - rho) * g2;
-    p->values.vec() -= ((eta * scale * gscale / sqrt(d2 + epsilon)) * p->g.vec() + reg);
-    p->clear();
-  }
-
-  pi = 0;
-  for (auto p : model->lookup_parameters_list()) {
-    vector<real>& hlgx = hlg[pi++];
-    for (auto i : p->non_zero_grads) {
-      real& d2 = hlgx[i];
-      auto reg = p->values[i].vec() * lambda;
-      real g2 = p->grads[i].vec().squaredNorm();
-      d2 = rho * d2 + (1.0 - rho) * g2;
-      p->values[i].vec() -= ((eta * scale * gscale / sqrt(d2 + epsilon)) * p->grads[i].vec() + reg);
-    }
-    p->clear();
+  const auto& params = model->parameters_list();
+  const auto& lookup_params = model->lookup_parameters_list();
+  // the step size of a parameter depends on the norm of its whole gradient,
+  // so the norms are taken before its elements are split among the tasks
+  for (unsigned k = 0; k < params.size(); ++k) {
+    real g2 = params[k]->g.vec().squaredNorm();
+    hg[k] = rho * hg[k] + (1.0 - rho) * g2;
   }
+  parallel_update(params, lookup_params, step,
+    [&](unsigned k, unsigned begin, unsigned end) {
+      Parameters* p = params[k];
+      sgd_kernel(end - begin, p->values.v + begin, p->g.v + begin, eta * scale * gscale / sqrt(hg[k] + epsilon), lambda);
+    },
+    [&](unsigned k, const unsigned* rows, unsigned n) {
+      LookupParameters* p = lookup_params[k];
+      vector<real>& hlgx = hlg[k];
+      for (unsigned r = 0; r < n; ++r) {
+        const unsigned i = rows[r];
+        real& d2 = hlgx[i];
+        real g2 = p->grads[i].vec().squaredNorm();
+        d2 = rho * d2 + (1.0 - rho) * g2;
+        sgd_kernel(p->dim.size(), p->values[i].v, p->grads[i].v, eta * scale * gscale / sqrt(d2 + epsilon), lambda);
+      }
+    });
   ++updates;
 }
 
 void AdamTrainer::update(real scale) {
-  unsigned pi;
   if (!shadow_params_allocated) {
     m = AllocateShadowParameters(*model);
     lm = AllocateShadowLookupParameters(*model);
@@ -251,50 +490,35 @@ void AdamTrainer::update(real scale) {
     shadow_params_allocated = true;
   }
 
+  const unsigned step = steps++;
   const float gscale = clip_gradients();
-  pi = 0;
+  const auto& params = model->parameters_list();
+  const auto& lookup_params = model->lookup_parameters_list();
   static unsigned t = 0;
-  for (auto p : model->parameters_list()) {
+  vector<float> s1(params.size()), s2(params.size());
+  for (unsigned k = 0; k < params.size(); ++k) {
     ++t;
-    auto g_t = (scale * gscale) * p->g.vec();
-    auto m_t = m[pi].h.vec();
-    auto v_t = v[pi].h.vec();
-    auto reg = p->values.vec() * lambda;
-    m_t = beta_1 * m_t + (1 - beta_1) * g_t;
-    auto g2 = g_t.cwiseProduct(g_t);
-    v_t = beta_2 * v_t + (1 - beta_2) * g2;
-    float s1 = 1 - pow(beta_1, t);
-    float s2 = 1 - pow(beta_2, t);
-    auto mhat = m_t / s1;
-    auto vhat = v_t / s2;
-    auto delta = (-eta * mhat).cwiseQuotient((vhat.array().sqrt() + eps).matrix());
-    p->values.vec() += delta - reg;
-    p->clear();
-    pi++;
-  }
-
-  pi = 0;
-  for (auto p : model->lookup_parameters_list()) {
-    vector<Tensor>& vm = lm[pi].h;
-    vector<Tensor>& vv = lv[pi].h;
-    for (auto i : p->non_zero_grads) {
-      auto m_t = vm[i].vec();
-      auto v_t = vv[i].vec();
-      auto g_t = scale * gscale * p->grads[i].vec();
-      auto g2 = g_t.cwiseProduct(g_t);
-      auto reg = p->values[i].vec() * lambda;
-      m_t = beta_1 * m_t + (1 - beta_1) * g_t;
-      v_t = beta_2 * v_t + (1 - beta_2) * g2;
-      float s1 = 1 - pow(beta_1, t);
-      float s2 = 1 - pow(beta_2, t);
-      auto mhat = m_t / s1;
-      auto vhat = v_t / s2;
-      auto delta = (-eta * mhat).cwiseQuotient((vhat.array().sqrt() + eps).matrix());
-      p->values[i].vec() += delta - reg;
-    }
-    p->clear();
-    pi++;
+    s1[k] = 1 - pow(beta_1, t);
+    s2[k] = 1 - pow(beta_2, t);
   }
+  const float ls1 = 1 - pow(beta_1, t);
+  const float ls2 = 1 - pow(beta_2, t);
+  parallel_update(params, lookup_params, step,
+    [&](unsigned k, unsigned begin, unsigned end) {
+      Parameters* p = params[k];
+      adam_kernel(end - begin, p->values.v + begin, p->g.v + begin, m[k].h.v + begin, v[k].h.v + begin,
+                  scale * gscale, beta_1, beta_2, s1[k], s2[k], eta, eps, lambda);
+    },
+    [&](unsigned k, const unsigned* rows, unsigned n) {
+      LookupParameters* p = lookup_params[k];
+      const vector<Tensor>& vm = lm[k].h;
+      const vector<Tensor>& vv = lv[k].h;
+      for (unsigned r = 0; r < n; ++r) {
+        const unsigned i = rows[r];
+        adam_kernel(p->dim.size(), p->values[i].v, p->grads[i].v, vm[i].v, vv[i].v, scale * gscale,
+                    beta_1, beta_2, ls1, ls2, eta, eps, lambda);
+      }
+    });
   ++updates;
 }
 
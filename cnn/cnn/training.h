@@ -2,14 +2,48 @@
 #define CNN_TRAINING_H_
 
 #include <vector>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include "cnn/model.h"
 #include "cnn/shadow-params.h"
+#include "cnn/thread-pool.h"
 
 namespace cnn {
 
+struct ComputationGraph;
+
+// parameter gradients collected by one thread, apart from the gradients
+// stored in the model, so that several threads can train the same model at
+// once: each builds its own graph, calls ComputationGraph::compute_gradients
+// and adds the result here.
+struct LocalGradients {
+  explicit LocalGradients(const Model& m);
+  // adds the gradients of cg's parameter nodes
+  void add(const ComputationGraph& cg);
+  float squared_l2norm() const;
+  // adds scale times these gradients to those stored in the model, e.g. to
+  // average the gradients of several threads before a Trainer::update
+  void accumulate_into_model(real scale) const;
+  void clear();
+
+  const Model* model;
+  std::vector<ShadowParameters> p;  // one per model.parameters_list()
+  std::vector<ShadowLookupParameters> lp;  // one per model.lookup_parameters_list()
+  std::vector<TouchedRows> lp_rows;  // rows of lp with a gradient
+ private:
+  std::unordered_map<const Parameters*, unsigned> p_index;
+  std::unordered_map<const LookupParameters*, unsigned> lp_index;
+};
+
 struct Trainer {
   explicit Trainer(Model* m, real lam, real e0) :
-    eta0(e0), eta(e0), eta_decay(), epoch(), lambda(lam), clipping_enabled(true), clip_threshold(5), clips(), updates(), model(m) {}
+    eta0(e0), eta(e0), eta_decay(), epoch(), lambda(lam), clipping_enabled(true), clip_threshold(5), clips(), updates(), model(m), steps(0) {
+    for (auto p : m->lookup_parameters_list())
+      track(p, 0);
+  }
   virtual ~Trainer();
 
   virtual void update(real scale = 1.0) = 0;
@@ -22,6 +56,12 @@ struct Trainer {
   // scale the gradient by (otherwise 1)
   float clip_gradients();
 
+  // splits the gradient norm and update() over n threads, by parameter and by
+  // ranges of the elements (or touched rows) of large parameters. every
+  // element gets the same arithmetic as with one thread, so only the gradient
+  // norm can change, and it is the same for any n > 1
+  void set_threads(unsigned n) { pool.reset(n > 1 ? new ThreadPool(n) : nullptr); }
+
   // learning rates
   real eta0;
   real eta;
@@ -42,12 +82,54 @@ struct Trainer {
   }
 
   Model* model;  // parameters and gradients live here
+
+  // the l2 regularization of lookup parameters is lazy, but has the effect
+  // of decaying every row at every update: an update only decays the rows
+  // it touches, and each of them first catches up, in closed form, with the
+  // decay of the updates it missed since it was last touched (or since the
+  // trainer was created). this applies the decay that every row still owes,
+  // e.g. before the model is evaluated or saved.
+  void flush_regularization();
+  // leaves p, a table that never gets a gradient (such as fixed pretrained
+  // embeddings read through const_lookup), out of the decay of untouched rows
+  void exempt_from_regularization(LookupParameters* p) { last_update[p].clear(); }
+
+ protected:
+  // regularizes the rows of p from update t on, and returns their entry of
+  // last_update
+  std::vector<std::atomic<int>>& track(LookupParameters* p, unsigned t);
+  // decays the given rows of p by the updates they missed before update t
+  // and marks them as regularized by update t in last, the entry of p
+  void catch_up(LookupParameters* p, std::vector<std::atomic<int>>& last,
+                const unsigned* rows, unsigned n, unsigned t);
+  // calls dense(k, begin, end) on ranges of the elements of params[k] and
+  // sparse(k, rows, n) on ranges of the touched rows of lookup_params[k],
+  // after catching those rows up with update t. the ranges run on the
+  // threads of set_threads, and their gradients are cleared when they are done
+  void parallel_update(const std::vector<Parameters*>& params,
+                       const std::vector<LookupParameters*>& lookup_params, unsigned t,
+                       const std::function<void(unsigned, unsigned, unsigned)>& dense,
+                       const std::function<void(unsigned, const unsigned*, unsigned)>& sparse);
+  std::atomic<unsigned> steps;  // updates so far, including Hogwild ones
+  // the last update that regularized each row, or none for an exempt
+  // table. the tables of the model are added when the trainer is created,
+  // and a table added later by the first update that sees it
+  std::unordered_map<LookupParameters*, std::vector<std::atomic<int>>> last_update;
+  // held by Hogwild updates while they look up (or add) their entries of
+  // last_update, since another thread may be adding one
+  std::mutex last_update_mutex;
+  std::unique_ptr<ThreadPool> pool;
 };
 
 struct SimpleSGDTrainer : public Trainer {
   explicit SimpleSGDTrainer(Model* m, real lam = 1e-6, real e0 = 0.1) : Trainer(m, lam, e0) {}
   void update(real scale) override;
   void update(const std::vector<LookupParameters*> &lookup_params, const std::vector<Parameters*> &params, real scale = 1);
+  // updates the parameters straight from one thread's gradients, without
+  // locking, while other threads do the same (Hogwild). the model's own
+  // gradients are not used and the clips and updates counters are left to
+  // the caller; returns true if the gradient was clipped.
+  bool hogwild_update(const LocalGradients& grads, real scale = 1);
 };
 
 struct MomentumSGDTrainer : public Trainer {
@@ -0,0 +1,74 @@
+#include "cnn/cnn.h"
+#include "cnn/model.h"
+#include "cnn/training.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace cnn;
+
+// times Trainer::update for every trainer on a model shaped like that of a
+// large parser: a few square weight matrices and a big embedding table of
+// which only some rows get a gradient in each update. only the updates are
+// timed; the gradients are filled in before each of them.
+//
+// usage: trainer-bench [--cnn-mem MB] [hidden] [vocab] [embedding] [rows] [updates] [threads]
+int main(int argc, char** argv) {
+  cnn::Initialize(argc, argv, 1);
+  vector<unsigned> opts = {1024, 200000, 100, 2000, 50, 1};
+  for (int i = 1; i < argc && i <= (int)opts.size(); ++i)
+    istringstream(argv[i]) >> opts[i - 1];
+  const unsigned hidden = opts[0], vocab = opts[1], emb = opts[2], rows = opts[3], updates = opts[4], threads = opts[5];
+  cerr << "hidden=" << hidden << " vocab=" << vocab << " embedding=" << emb
+       << " rows=" << rows << " updates=" << updates << " threads=" << threads << endl;
+
+  // parameter memory is not given back, so all the trainers share the model
+  Model model;
+  vector<Parameters*> params;
+  for (unsigned i = 0; i < 4; ++i)
+    params.push_back(model.add_parameters({hidden, hidden}));
+  LookupParameters* table = model.add_lookup_parameters(vocab, {emb});
+  // the gradients of every update are copies of these
+  vector<vector<float>> grads;
+  for (auto p : params) {
+    grads.emplace_back(p->dim.size());
+    for (auto& g : grads.back()) g = rand01() - 0.5;
+  }
+  vector<float> row_grad(emb);
+  for (auto& g : row_grad) g = rand01() - 0.5;
+  Tensor row_grad_tensor(Dim({emb}), &row_grad[0]);
+
+  const vector<string> names = {"sgd", "momentum", "adagrad", "adadelta", "rmsprop", "adam"};
+  for (const string& name : names) {
+    unique_ptr<Trainer> trainer;
+    if (name == "sgd") trainer.reset(new SimpleSGDTrainer(&model));
+    else if (name == "momentum") trainer.reset(new MomentumSGDTrainer(&model));
+    else if (name == "adagrad") trainer.reset(new AdagradTrainer(&model));
+    else if (name == "adadelta") trainer.reset(new AdadeltaTrainer(&model));
+    else if (name == "rmsprop") trainer.reset(new RmsPropTrainer(&model));
+    else trainer.reset(new AdamTrainer(&model));
+    // time the update kernels, not the gradient norm
+    trainer->clipping_enabled = false;
+    trainer->set_threads(threads);
+
+    // the first update allocates the state of the trainer and is not timed
+    double ms = 0;
+    for (unsigned u = 0; u <= updates; ++u) {
+      for (unsigned k = 0; k < params.size(); ++k)
+        memcpy(params[k]->g.v, &grads[k][0], grads[k].size() * sizeof(float));
+      for (unsigned r = 0; r < rows; ++r)
+        table->accumulate_grad(rand0n(vocab), row_grad_tensor);
+      auto start = chrono::high_resolution_clock::now();
+      trainer->update(1.0);
+      auto end = chrono::high_resolution_clock::now();
+      if (u) ms += chrono::duration<double, milli>(end - start).count();
+    }
+    cout << name << "\t" << (ms / updates) << " ms/update" << endl;
+  }
+}
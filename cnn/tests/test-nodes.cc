@@ -1,7 +1,11 @@
 #include <cnn/cnn.h>
 #include <cnn/expr.h>
 #include <cnn/grad-check.h>
+#include <cnn/lstm.h>
+#include <cnn/thread-pool.h>
+#include <cnn/training.h>
 #include <boost/test/unit_test.hpp>
+#include <cstdio>
 #include <stdexcept>
 
 using namespace cnn;
@@ -366,6 +370,19 @@ BOOST_AUTO_TEST_CASE( restricted_log_softmax_gradient ) {
   BOOST_CHECK(CheckGrad(mod, cg, 0));
 }
 
+// Expression masked_argmax(const Expression& x, const std::vector<unsigned>& mask);
+BOOST_AUTO_TEST_CASE( masked_argmax_gradient ) {
+  vector<unsigned> mask = {1,0};
+  cnn::ComputationGraph cg;
+  Expression x1 = parameter(cg, param1);
+  Expression y = masked_argmax(x1, mask);
+  vector<float> best = as_vector(cg.incremental_forward(y));
+  BOOST_CHECK_EQUAL(best[0], 0.f);
+  BOOST_CHECK_CLOSE(best[1], 1.1f, 0.001);
+  input(cg, {1,2}, ones2_vals) * y;
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
 // Expression softmax(const Expression& x);
 BOOST_AUTO_TEST_CASE( softmax_gradient ) {
   cnn::ComputationGraph cg;
@@ -578,6 +595,86 @@ BOOST_AUTO_TEST_CASE( pickrange_gradient ) {
   BOOST_CHECK(CheckGrad(mod, cg, 0));
 }
 
+// Expression pick_batch_elem(const Expression& x, unsigned b);
+BOOST_AUTO_TEST_CASE( pick_batch_elem_gradient ) {
+  cnn::ComputationGraph cg;
+  Expression x1 = parameter(cg, param1);
+  Expression x2 = input(cg, Dim({3},2), batch_vals);
+  Expression y = pick_batch_elem(x1+x2, 1);
+  input(cg, {1,3}, ones3_vals) * cwise_multiply(y, y);
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// Expression concatenate_to_batch(const std::initializer_list<Expression> xs);
+BOOST_AUTO_TEST_CASE( concatenate_to_batch_gradient ) {
+  cnn::ComputationGraph cg;
+  Expression x1 = parameter(cg, param1);
+  Expression x2 = parameter(cg, param2);
+  Expression x3 = input(cg, Dim({3},2), batch_vals);
+  Expression y = concatenate_to_batch({x1, x2+x3});
+  sum_batches(input(cg, {1,3}, ones3_vals) * cwise_multiply(y, y));
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// Expression lstm_cell(const T& xs);
+BOOST_AUTO_TEST_CASE( lstm_cell_gradient ) {
+  LSTMBuilder builder(1, 3, 3, &mod);
+  cnn::ComputationGraph cg;
+  builder.new_graph(cg);
+  builder.start_new_sequence();
+  builder.add_input(parameter(cg, param1));
+  Expression y = builder.add_input(parameter(cg, param2));
+  Expression c = builder.final_s().front();
+  Expression ones3 = input(cg, {1,3}, ones3_vals);
+  ones3 * y + ones3 * c;
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// Expression lstm_cell(const T& xs);
+BOOST_AUTO_TEST_CASE( lstm_cell_batch_gradient ) {
+  LSTMBuilder builder(1, 3, 3, &mod);
+  cnn::ComputationGraph cg;
+  builder.new_graph(cg);
+  builder.start_new_sequence();
+  builder.add_input(parameter(cg, param1));
+  std::vector<RNNPointer> prev = {RNNPointer(0), RNNPointer(-1)};
+  std::vector<RNNPointer> cur = builder.add_input_batch(prev, {parameter(cg, param2), parameter(cg, param3)});
+  Expression ones3 = input(cg, {1,3}, ones3_vals);
+  ones3 * builder.get_h(cur[0]).front() + ones3 * builder.get_s(cur[1]).front();
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// Expression lstm_cell(const std::vector<Expression>& xs, unsigned t);
+BOOST_AUTO_TEST_CASE( lstm_cell_projected_gradient ) {
+  LSTMBuilder builder(1, 3, 3, &mod);
+  cnn::ComputationGraph cg;
+  builder.new_graph(cg);
+  builder.start_new_sequence();
+  std::vector<Expression> ys = builder.add_inputs({parameter(cg, param1), parameter(cg, param2), parameter(cg, param3)});
+  Expression ones3 = input(cg, {1,3}, ones3_vals);
+  ones3 * ys[1] + ones3 * ys[2] + ones3 * builder.final_s().front();
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// the loss is linear in the cell's outputs, so both backward passes get the
+// same dEdf but must not reuse the gate gradients of the first forward values
+BOOST_AUTO_TEST_CASE( lstm_cell_repeated_backward ) {
+  LSTMBuilder builder(1, 3, 3, &mod);
+  std::vector<float> x_vals = {1.f, 2.f, 3.f};
+  cnn::ComputationGraph cg;
+  builder.new_graph(cg);
+  builder.start_new_sequence();
+  builder.add_input(input(cg, {3}, &x_vals));
+  Expression y = builder.add_input(parameter(cg, param2));
+  Expression c = builder.final_s().front();
+  Expression ones3 = input(cg, {1,3}, ones3_vals);
+  ones3 * y + ones3 * c;
+  cg.forward();
+  cg.backward();
+  x_vals = {-0.5f, 0.25f, 2.f};
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
 // Expression pickneglogsoftmax(const Expression& x, unsigned v);
 BOOST_AUTO_TEST_CASE( pickneglogsoftmax_gradient ) {
   unsigned idx = 1;
@@ -597,4 +694,123 @@ BOOST_AUTO_TEST_CASE( pickneglogsoftmax_batch_gradient ) {
   BOOST_CHECK(CheckGrad(mod, cg, 0));
 }
 
+// void ComputationGraph::checkpoint(); void ComputationGraph::revert();
+BOOST_AUTO_TEST_CASE( checkpoint_revert_gradient ) {
+  cnn::ComputationGraph cg;
+  Expression x1 = parameter(cg, param1);
+  Expression x2 = parameter(cg, param2);
+  cg.checkpoint();
+  for (unsigned i = 0; i < 2; ++i) {
+    cg.revert();
+    Expression ones3 = input(cg, {1,3}, ones3_vals);
+    Expression y = (i ? cwise_multiply(x1, x2) : x1 + x2);
+    ones3 * y;
+    BOOST_CHECK_EQUAL(cg.nodes.size(), 5u);
+    BOOST_CHECK_EQUAL(cg.parameter_nodes.size(), 2u);
+    BOOST_CHECK_CLOSE(as_scalar(cg.forward()), i ? -9.02f : 6.6f, 0.001);
+    BOOST_CHECK(CheckGrad(mod, cg, 0));
+  }
+}
+
+// the gradient norm split over threads is the same for any number of them
+BOOST_AUTO_TEST_CASE( gradient_l2_norm_threads ) {
+  Model m;
+  Parameters* p = m.add_parameters({100000});
+  LookupParameters* lp = m.add_lookup_parameters(2000, {10});
+  for (unsigned i = 0; i < p->g.d.size(); ++i) p->g.v[i] = rand01() - 0.5;
+  std::vector<float> row(10, 0.25f);
+  Tensor row_grad(Dim({10}), &row[0]);
+  for (unsigned i = 0; i < 2000; i += 3) lp->accumulate_grad(i, row_grad);
+  ThreadPool pool2(2), pool3(3);
+  const float serial = m.gradient_l2_norm();
+  const float two = m.gradient_l2_norm(&pool2);
+  BOOST_CHECK_EQUAL(two, m.gradient_l2_norm(&pool3));
+  BOOST_CHECK_CLOSE(two, serial, 0.001);
+}
+
+// the lazy l2 regularization of a lookup table decays every row at every
+// update, as if it were dense, once the trainer has been flushed
+BOOST_AUTO_TEST_CASE( lazy_regularization_matches_dense ) {
+  Model m;
+  LookupParameters* lp = m.add_lookup_parameters(2, {1});
+  TensorTools::SetElements(lp->values[0], {2.f});
+  TensorTools::SetElements(lp->values[1], {3.f});
+  SimpleSGDTrainer sgd(&m, 0.1, 0.5);
+  sgd.clipping_enabled = false;
+  std::vector<float> grad_vals = {1.f};
+  Tensor grad(Dim({1}), &grad_vals[0]);
+  for (unsigned t = 0; t < 4; ++t) {
+    if (t == 2) lp->accumulate_grad(0, grad);
+    sgd.update(1.0);
+  }
+  sgd.flush_regularization();
+  // row 0: decayed by updates 0 and 1, then 2 with its gradient, then 3
+  BOOST_CHECK_CLOSE(as_vector(lp->values[0])[0], (2.f * 0.9f * 0.9f * 0.9f - 0.5f) * 0.9f, 0.001);
+  BOOST_CHECK_CLOSE(as_vector(lp->values[1])[0], 3.f * 0.9f * 0.9f * 0.9f * 0.9f, 0.001);
+}
+
+// a table added after the trainer decays from the first update that sees
+// it on, with update() as with hogwild_update()
+BOOST_AUTO_TEST_CASE( lazy_regularization_of_late_table ) {
+  for (bool hogwild : {false, true}) {
+    Model m;
+    SimpleSGDTrainer sgd(&m, 0.1, 0.5);
+    sgd.clipping_enabled = false;
+    sgd.update(1.0);
+    sgd.update(1.0);
+    LookupParameters* lp = m.add_lookup_parameters(2, {1});
+    TensorTools::SetElements(lp->values[0], {2.f});
+    TensorTools::SetElements(lp->values[1], {3.f});
+    LocalGradients grads(m);
+    std::vector<float> grad_vals = {1.f};
+    Tensor grad(Dim({1}), &grad_vals[0]);
+    for (unsigned t = 2; t < 5; ++t) {
+      if (hogwild) {
+        if (t == 3) {
+          grads.lp_rows[0].insert(0);
+          TensorTools::SetElements(grads.lp[0].h[0], grad_vals);
+        }
+        sgd.hogwild_update(grads, 1.0);
+        grads.clear();
+      } else {
+        if (t == 3) lp->accumulate_grad(0, grad);
+        sgd.update(1.0);
+      }
+    }
+    sgd.flush_regularization();
+    // row 0: decayed by update 2, then 3 with its gradient, then 4
+    BOOST_CHECK_CLOSE(as_vector(lp->values[0])[0], (2.f * 0.9f * 0.9f - 0.5f) * 0.9f, 0.001);
+    BOOST_CHECK_CLOSE(as_vector(lp->values[1])[0], 3.f * 0.9f * 0.9f * 0.9f, 0.001);
+  }
+}
+
+// a lookup table read from a text archive is read into its block, so the
+// binary model written from it holds the same values and computes the same
+BOOST_AUTO_TEST_CASE( lookup_text_load_in_block ) {
+  const string text_file = "test-lookup.params", binary_file = "test-lookup.bin";
+  Model text_model;
+  LookupParameters* text_lp = text_model.add_lookup_parameters(5, {3});
+  save_cnn_model(text_file, &text_model);
+  Model loaded_model;
+  LookupParameters* loaded_lp = loaded_model.add_lookup_parameters(5, {3});
+  load_cnn_model(text_file, &loaded_model);
+  save_cnn_model_binary(binary_file, loaded_model);
+  Model binary_model;
+  LookupParameters* binary_lp = binary_model.add_lookup_parameters(5, {3});
+  load_cnn_model_binary(binary_file, &binary_model);
+  remove(text_file.c_str());
+  remove(binary_file.c_str());
+  for (unsigned i = 0; i < 5; ++i) {
+    BOOST_CHECK(loaded_lp->values[i].v == loaded_lp->all_values.v + i * loaded_lp->stride);
+    BOOST_CHECK(as_vector(loaded_lp->values[i]) == as_vector(text_lp->values[i]));
+    BOOST_CHECK(as_vector(binary_lp->values[i]) == as_vector(text_lp->values[i]));
+  }
+  ComputationGraph cg;
+  Expression ones3 = input(cg, {1,3}, ones3_vals);
+  Expression x = ones3 * lookup(cg, text_lp, 2);
+  Expression y = ones3 * lookup(cg, binary_lp, 2);
+  cg.forward();
+  BOOST_CHECK_EQUAL(as_scalar(x.value()), as_scalar(y.value()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,13 +9,131 @@
 #include <vector>
 #include <set>
 #include <unordered_map>
+#include <unordered_set>
 #include <functional>
 #include <vector>
 #include <map>
 #include <string>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 
 namespace cpyp {
 
+// open-addressing hash table (linear probing) from strings to ids, with the
+// keys stored back to back in a single arena. as with the std::map it
+// replaces, operator[] inserts a missing key with id 0, so 0 doubles as
+// "not present".
+class StringIdMap {
+ public:
+  StringIdMap() : slots_(16, 0), offsets_(1, 0) {}
+
+  unsigned& operator[](const std::string& key) {
+    const uint64_t h = hash(key);
+    size_t i = probe(key, h);
+    if (slots_[i] == 0) {
+      if ((values_.size() + 1) * 4 > slots_.size() * 3) {
+        grow();
+        i = probe(key, h);
+      }
+      arena_.append(key);
+      offsets_.push_back(arena_.size());
+      hashes_.push_back(h);
+      values_.push_back(0);
+      slots_[i] = values_.size();
+    }
+    return values_[slots_[i] - 1];
+  }
+
+  // id of key, or 0 if it is not present; never inserts
+  unsigned lookup(const std::string& key) const {
+    const unsigned e = slots_[probe(key, hash(key))];
+    return e ? values_[e - 1] : 0;
+  }
+
+  size_t count(const std::string& key) const {
+    return slots_[probe(key, hash(key))] != 0;
+  }
+
+  size_t size() const { return values_.size(); }
+
+ private:
+  static uint64_t hash(const std::string& key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : key) h = (h ^ c) * 1099511628211ULL;
+    return h;
+  }
+
+  // slot holding key, or the empty slot where it would be inserted
+  size_t probe(const std::string& key, uint64_t h) const {
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = h & mask; ; i = (i + 1) & mask) {
+      const unsigned e = slots_[i];
+      if (e == 0) return i;
+      if (hashes_[e - 1] == h && offsets_[e] - offsets_[e - 1] == key.size() &&
+          memcmp(arena_.data() + offsets_[e - 1], key.data(), key.size()) == 0)
+        return i;
+    }
+  }
+
+  void grow() {
+    std::vector<unsigned> slots(slots_.size() * 2, 0);
+    const size_t mask = slots.size() - 1;
+    for (unsigned e = 1; e <= values_.size(); ++e) {
+      size_t i = hashes_[e - 1] & mask;
+      while (slots[i]) i = (i + 1) & mask;
+      slots[i] = e;
+    }
+    slots_.swap(slots);
+  }
+
+  std::vector<unsigned> slots_;  // entry + 1, or 0 for an empty slot
+  std::string arena_;  // key of entry e is arena_[offsets_[e], offsets_[e + 1])
+  std::vector<size_t> offsets_;
+  std::vector<uint64_t> hashes_;
+  std::vector<unsigned> values_;
+};
+
+// dense id -> string table, with the strings stored back to back in a
+// single arena. ids are assigned in increasing order; skipped ids map to
+// the empty string.
+class StringTable {
+ public:
+  StringTable() : offsets_(1, 0) {}
+
+  void set(unsigned id, const std::string& s) {
+    // an id out of order would be appended at the wrong index and shift
+    // every later one, so it is an error even in release builds
+    if (id < size()) {
+      std::cerr << "StringTable: id " << id << " ('" << s << "') set after id "
+                << size() - 1 << std::endl;
+      abort();
+    }
+    while (size() < id) offsets_.push_back(arena_.size());
+    arena_.append(s);
+    offsets_.push_back(arena_.size());
+  }
+
+  std::string operator[](unsigned id) const {
+    assert(id < size());
+    return arena_.substr(offsets_[id], offsets_[id + 1] - offsets_[id]);
+  }
+
+  // true if id has been assigned a (non-empty) string
+  bool contains(unsigned id) const {
+    return id < size() && offsets_[id + 1] > offsets_[id];
+  }
+
+  unsigned size() const { return offsets_.size() - 1; }
+
+ private:
+  std::string arena_;
+  std::vector<size_t> offsets_;
+};
+
 class Corpus {
  //typedef std::unordered_map<std::string, unsigned, std::hash<std::string> > Map;
 // typedef std::unordered_map<unsigned,std::string, std::hash<std::string> > ReverseMap;
@@ -42,16 +160,16 @@ public:
    int max;
    int maxPos;
 
-   std::map<std::string, unsigned> wordsToInt;
-   std::map<unsigned, std::string> intToWords;
+   StringIdMap wordsToInt;
+   StringTable intToWords;
    std::vector<std::string> actions;
 
-   std::map<std::string, unsigned> posToInt;
-   std::map<unsigned, std::string> intToPos;
+   StringIdMap posToInt;
+   StringTable intToPos;
 
    int maxChars;
-   std::map<std::string, unsigned> charsToInt;
-   std::map<unsigned, std::string> intToChars;
+   StringIdMap charsToInt;
+   StringTable intToChars;
 
    // String literals
    static constexpr const char* UNK = "UNK";
@@ -97,17 +215,17 @@ inline void load_correct_actions(std::string file){
   bool initial=false;
   bool first=true;
   wordsToInt[Corpus::BAD0] = 0;
-  intToWords[0] = Corpus::BAD0;
+  intToWords.set(0, Corpus::BAD0);
   wordsToInt[Corpus::UNK] = 1; // unknown symbol
-  intToWords[1] = Corpus::UNK;
+  intToWords.set(1, Corpus::UNK);
   assert(max == 0);
   assert(maxPos == 0);
   max=2;
   maxPos=1;
   
   charsToInt[BAD0]=1;
-  intToChars[1]="BAD0";
-  maxChars=1;
+  intToChars.set(1, "BAD0");
+  maxChars=2;
   
 	std::vector<unsigned> current_sent;
   std::vector<unsigned> current_sent_pos;
@@ -160,7 +278,7 @@ inline void load_correct_actions(std::string file){
           // new POS tag
           if (posToInt[pos] == 0) {
             posToInt[pos] = maxPos;
-            intToPos[maxPos] = pos;
+            intToPos.set(maxPos, pos);
             npos = maxPos;
             maxPos++;
           }
@@ -168,7 +286,7 @@ inline void load_correct_actions(std::string file){
           // new word
           if (wordsToInt[word] == 0) {
             wordsToInt[word] = max;
-            intToWords[max] = word;
+            intToWords.set(max, word);
             nwords = max;
             max++;
 
@@ -180,7 +298,7 @@ inline void load_correct_actions(std::string file){
               }
               if (charsToInt[wj] == 0) {
                 charsToInt[wj] = maxChars;
-                intToChars[maxChars] = wj;
+                intToChars.set(maxChars, wj);
                 maxChars++;
               }
               j += UTF8Len(word[j]);
@@ -253,7 +371,7 @@ inline unsigned get_or_add_word(const std::string& word) {
   if (id == 0) {
     id = max;
     ++max;
-    intToWords[id] = word;
+    intToWords.set(id, word);
     nwords = max;
   }
   return id;
@@ -318,7 +436,7 @@ inline void load_correct_actionsDev(std::string file) {
           // new POS tag
           if (posToInt[pos] == 0) {
             posToInt[pos] = maxPos;
-            intToPos[maxPos] = pos;
+            intToPos.set(maxPos, pos);
             npos = maxPos;
             maxPos++;
           }
@@ -331,7 +449,7 @@ inline void load_correct_actionsDev(std::string file) {
               max = nwords + 1;
               //std::cerr<< "max:" << max << "\n";
               wordsToInt[word] = max;
-              intToWords[max] = word;
+              intToWords.set(max, word);
               nwords = max;
             } else {
               // save the surface form of this OOV before overwriting it.
@@ -370,6 +488,218 @@ inline void load_correct_actionsDev(std::string file) {
   actionsFile.close();
 }
 
+// adds the surface form of every token in an oracle file (in the format
+// read by load_correct_actionsDev) to words, leaving the corpus unchanged
+inline void read_oracle_words(const std::string& file,
+                              std::unordered_set<std::string>* words) {
+  std::ifstream actionsFile(file);
+  std::string lineS;
+  bool initial = false;
+  while (getline(actionsFile, lineS)) {
+    if (lineS.empty()) {
+      initial = true;
+      continue;
+    }
+    if (!initial) continue;
+    initial = false;
+    ReplaceStringInPlace(lineS, "-RRB-", "_RRB_");
+    ReplaceStringInPlace(lineS, "-LRB-", "_LRB_");
+    std::istringstream iss(lineS.substr(3, lineS.size() - 4));
+    std::string word;
+    while (iss >> word) {
+      if (word[word.size() - 1] == ',') word.resize(word.size() - 1);
+      size_t posIndex = word.rfind('-');
+      assert(posIndex != std::string::npos);
+      words->insert(word.substr(0, posIndex));
+    }
+  }
+}
+
+// writes the word, POS tag and action tables, marking the words that were
+// seen in training and those with a pretrained vector, so that a trained
+// parser can be loaded without reading the training oracle again
+inline void save_vocabulary(const std::string& file,
+                            const std::set<unsigned>& training_vocab,
+                            const std::vector<bool>& pretrained_vocab) const {
+  std::ofstream out(file);
+  out << "lstm-parse-vocabulary 1\n";
+  out << "nwords " << nwords << ' ' << max << '\n';
+  out << "npos " << npos << ' ' << maxPos << '\n';
+  unsigned n = 0;
+  for (unsigned id = 0; id < intToWords.size(); ++id) n += intToWords.contains(id);
+  out << "words " << n << '\n';
+  for (unsigned id = 0; id < intToWords.size(); ++id) {
+    if (!intToWords.contains(id)) continue;
+    unsigned flags = (training_vocab.count(id) ? 1 : 0) |
+                     (id < pretrained_vocab.size() && pretrained_vocab[id] ? 2 : 0);
+    out << id << '\t' << intToWords[id] << '\t' << flags << '\n';
+  }
+  n = 0;
+  for (unsigned id = 0; id < intToPos.size(); ++id) n += intToPos.contains(id);
+  out << "pos " << n << '\n';
+  for (unsigned id = 0; id < intToPos.size(); ++id)
+    if (intToPos.contains(id))
+      out << id << '\t' << intToPos[id] << '\n';
+  out << "actions " << actions.size() << '\n';
+  for (auto& a : actions)
+    out << a << '\n';
+  if (!out) {
+    std::cerr << "could not write vocabulary to " << file << std::endl;
+    abort();
+  }
+}
+
+// restores the tables written by save_vocabulary, in place of
+// load_correct_actions
+inline void load_vocabulary(const std::string& file,
+                            std::set<unsigned>* training_vocab,
+                            std::vector<bool>* pretrained_vocab) {
+  std::ifstream in(file);
+  std::string tag, lineS;
+  unsigned version = 0, n = 0;
+  in >> tag >> version;
+  if (tag != "lstm-parse-vocabulary" || version != 1) {
+    std::cerr << file << " is not a vocabulary file" << std::endl;
+    abort();
+  }
+  // a truncated or edited file must not be read as a different vocabulary
+  auto expect = [&](const char* section) {
+    if (!in || tag != section) {
+      std::cerr << "malformed vocabulary file " << file << ": expected the "
+                << section << " section" << std::endl;
+      abort();
+    }
+  };
+  auto next_line = [&]() {
+    if (!getline(in, lineS)) {
+      std::cerr << "truncated vocabulary file " << file << std::endl;
+      abort();
+    }
+  };
+  auto malformed = [&]() {
+    std::cerr << "malformed vocabulary file " << file << ": '" << lineS << "'" << std::endl;
+    abort();
+  };
+  // the unsigned number in lineS[begin, end), which must hold nothing else
+  auto number = [&](size_t begin, size_t end) -> unsigned {
+    const std::string field = lineS.substr(begin, end - begin);
+    if (field.empty() || !isdigit((unsigned char)field[0])) malformed();
+    char* field_end;
+    errno = 0;
+    const unsigned long x = strtoul(field.c_str(), &field_end, 10);
+    if (*field_end || errno == ERANGE || x > UINT_MAX) malformed();
+    return x;
+  };
+  in >> tag >> nwords >> max;
+  expect("nwords");
+  in >> tag >> npos >> maxPos;
+  expect("npos");
+  in >> tag >> n;
+  expect("words");
+  getline(in, lineS);
+  for (unsigned i = 0; i < n; ++i) {
+    next_line();
+    size_t t1 = lineS.find('\t'), t2 = lineS.rfind('\t');
+    if (t1 == std::string::npos || t2 <= t1) malformed();
+    unsigned id = number(0, t1);
+    std::string word = lineS.substr(t1 + 1, t2 - t1 - 1);
+    unsigned flags = number(t2 + 1, lineS.size());
+    wordsToInt[word] = id;
+    intToWords.set(id, word);
+    if (flags & 1) training_vocab->insert(id);
+    if (flags & 2) {
+      if (id >= pretrained_vocab->size()) pretrained_vocab->resize(id + 1);
+      (*pretrained_vocab)[id] = true;
+    }
+  }
+  in >> tag >> n;
+  expect("pos");
+  getline(in, lineS);
+  for (unsigned i = 0; i < n; ++i) {
+    next_line();
+    size_t t1 = lineS.find('\t');
+    if (t1 == std::string::npos) malformed();
+    unsigned id = number(0, t1);
+    std::string pos = lineS.substr(t1 + 1);
+    posToInt[pos] = id;
+    intToPos.set(id, pos);
+  }
+  in >> tag >> n;
+  expect("actions");
+  getline(in, lineS);
+  actions.clear();
+  for (unsigned i = 0; i < n; ++i) {
+    getline(in, lineS);
+    actions.push_back(lineS);
+  }
+  if (!in) {
+    std::cerr << "truncated vocabulary file " << file << std::endl;
+    abort();
+  }
+  nactions = actions.size();
+  nsentences = 0;
+}
+
+// reads the next sentence of CoNLL input (one token per line, FORM in the
+// 2nd column and POSTAG in the 5th, sentences separated by blank lines) and
+// converts it the same way load_correct_actionsDev converts the oracle:
+// OOV words become UNK with their surface form saved in sentStr, and the
+// ROOT token is appended at the end. unknown POS tags become 0, the tag
+// without an embedding, with the tag saved in sentPosStr; they are not
+// added to the vocabulary, which would otherwise grow with every new tag
+// a server is sent. returns false if the input has no more sentences.
+inline bool read_conll_sentence(std::istream& in,
+                                std::vector<unsigned>* sent,
+                                std::vector<unsigned>* sentPos,
+                                std::vector<std::string>* sentStr,
+                                std::vector<std::string>* sentPosStr) {
+  sent->clear();
+  sentPos->clear();
+  sentStr->clear();
+  sentPosStr->clear();
+  std::string lineS;
+  while (getline(in, lineS)) {
+    if (lineS.size() && lineS[lineS.size() - 1] == '\r')
+      lineS.resize(lineS.size() - 1);
+    if (lineS.empty()) {
+      if (sent->size()) break;
+      continue;
+    }
+    if (lineS[0] == '#') continue;
+    std::vector<std::string> fields;
+    std::istringstream iss(lineS);
+    std::string field;
+    while (getline(iss, field, '\t')) fields.push_back(field);
+    if (fields.size() < 5) {
+      std::cerr << "bad CoNLL line: '" << lineS << "'" << std::endl;
+      continue;
+    }
+    // skip multiword tokens and empty nodes (CoNLL-U)
+    if (fields[0].find_first_of("-.") != std::string::npos) continue;
+    std::string word = fields[1];
+    std::string pos = (fields[4] == "_" ? fields[3] : fields[4]);
+    ReplaceStringInPlace(word, "-RRB-", "_RRB_");
+    ReplaceStringInPlace(word, "-LRB-", "_LRB_");
+    const unsigned id = wordsToInt.lookup(word);
+    if (id == 0) {
+      sentStr->push_back(word);
+      sent->push_back(wordsToInt.lookup(Corpus::UNK));
+    } else {
+      sentStr->push_back("");
+      sent->push_back(id);
+    }
+    const unsigned pid = posToInt.lookup(pos);
+    sentPos->push_back(pid);
+    sentPosStr->push_back(pid ? "" : pos);
+  }
+  if (sent->empty()) return false;
+  sent->push_back(wordsToInt.lookup("ROOT"));
+  sentPos->push_back(posToInt.lookup("ROOT"));
+  sentStr->push_back("");
+  sentPosStr->push_back("");
+  return true;
+}
+
 void ReplaceStringInPlace(std::string& subject, const std::string& search,
                           const std::string& replace) {
     size_t pos = 0;
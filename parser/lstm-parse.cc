@@ -1,4 +1,6 @@
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
 #include <algorithm>
 #include <sstream>
 #include <iostream>
@@ -7,6 +9,10 @@
 #include <cmath>
 #include <chrono>
 #include <ctime>
+#include <iomanip>
+#include <memory>
+#include <thread>
+#include <atomic>
 
 #include <unordered_map>
 #include <unordered_set>
@@ -14,8 +20,9 @@
 #include <execinfo.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-#include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/program_options.hpp>
 
@@ -26,6 +33,7 @@
 #include "cnn/lstm.h"
 #include "cnn/rnn.h"
 #include "c2.h"
+#include "pretrained.h"
 
 cpyp::Corpus corpus;
 volatile bool requested_stop = false;
@@ -40,6 +48,7 @@ unsigned REL_DIM = 8;
 
 
 bool USE_POS = false;
+unsigned BEAM_SIZE = 1;  // greedy decoding
 
 constexpr const char* ROOT_SYMBOL = "ROOT";
 unsigned kROOT_SYMBOL = 0;
@@ -53,17 +62,80 @@ using namespace std;
 namespace po = boost::program_options;
 
 vector<unsigned> possible_actions;
-unordered_map<unsigned, vector<float>> pretrained;
+vector<bool> pretrained_vocab; // words with a row in p_t, indexed by word id
+
+enum ActionKind { SHIFT, SWAP, LEFT, RIGHT };
+
+// the transitions, compiled once from their names (SHIFT, SWAP,
+// LEFT-ARC(rel) and RIGHT-ARC(rel)) so that parsing never inspects strings
+struct ActionTable {
+  vector<ActionKind> kind;
+  vector<unsigned> rel;  // relation of LEFT and RIGHT actions
+  vector<string> rel_names;  // the relation labels written to the output
+
+  void compile(const vector<string>& names) {
+    kind.resize(names.size());
+    rel.assign(names.size(), 0);
+    rel_names.clear();
+    map<string, unsigned> rel_ids;
+    for (unsigned a = 0; a < names.size(); ++a) {
+      const string& name = names[a];
+      if (name[0] == 'S' && name[1] == 'H') kind[a] = SHIFT;
+      else if (name[0] == 'S' && name[1] == 'W') kind[a] = SWAP;
+      else if (name[0] == 'L') kind[a] = LEFT;
+      else if (name[0] == 'R') kind[a] = RIGHT;
+      else {
+        cerr << "Unknown action: " << name << endl;
+        abort();
+      }
+      if (kind[a] == LEFT || kind[a] == RIGHT) {
+        const size_t first = name.find('(') + 1, last = name.rfind(')') - 1;
+        auto it = rel_ids.insert(make_pair(name.substr(first, last - first + 1), rel_names.size())).first;
+        if (it->second == rel_names.size()) rel_names.push_back(it->first);
+        rel[a] = it->second;
+      }
+    }
+    for (unsigned kinds = 0; kinds < 16; ++kinds) {
+      valid_actions[kinds].clear();
+      for (auto a : possible_actions)
+        if (kinds & (1u << kind[a])) valid_actions[kinds].push_back(a);
+    }
+  }
+
+  // the actions allowed in a parser state, in the order of possible_actions.
+  // they only depend on which kinds of action are allowed, so the lists for
+  // every combination of kinds are built by compile
+  const vector<unsigned>& valid(unsigned bsize, unsigned ssize, const vector<int>& stacki) const {
+    unsigned kinds = 0;
+    // ROOT has to stay on the buffer until the stack holds a single word
+    if (bsize > 1 && !(bsize == 2 && ssize > 2)) kinds |= 1u << SHIFT;
+    if (ssize > 2) {
+      kinds |= 1u << LEFT;
+      // only attach left to ROOT
+      if (!(bsize == 1 && ssize == 3)) kinds |= 1u << RIGHT;
+      // only swap words that are still in sentence order
+      if (stacki[stacki.size() - 2] <= stacki.back()) kinds |= 1u << SWAP;
+    }
+    return valid_actions[kinds];
+  }
+
+ private:
+  vector<unsigned> valid_actions[16];
+};
+ActionTable action_table;
 
 void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
   po::options_description opts("Configuration options");
   opts.add_options()
         ("training_data,T", po::value<string>(), "List of Transitions - Training corpus")
+        ("vocab", po::value<string>(), "Load the vocabulary written during training instead of reading --training_data")
         ("dev_data,d", po::value<string>(), "Development corpus")
         ("test_data,p", po::value<string>(), "Test corpus")
         ("unk_strategy,o", po::value<unsigned>()->default_value(1), "Unknown word strategy: 1 = singletons become UNK with probability unk_prob")
         ("unk_prob,u", po::value<double>()->default_value(0.2), "Probably with which to replace singletons with UNK in training data")
-        ("model,m", po::value<string>(), "Load saved model from this file")
+        ("model,m", po::value<string>(), "Load saved model from this file (binary format or boost text archive)")
+        ("mmap_model", "Map the binary --model file read-only instead of reading it (inference only)")
+        ("convert_model", po::value<string>(), "Write the model loaded with --model to this file in the binary format and exit")
         ("use_pos_tags,P", "make POS tags visible to parser")
         ("layers", po::value<unsigned>()->default_value(2), "number of LSTM layers")
         ("action_dim", po::value<unsigned>()->default_value(16), "action embedding size")
@@ -73,8 +145,16 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
         ("pos_dim", po::value<unsigned>()->default_value(12), "POS dimension")
         ("rel_dim", po::value<unsigned>()->default_value(10), "relation dimension")
         ("lstm_input_dim", po::value<unsigned>()->default_value(60), "LSTM input dimension")
+        ("decode_batch_size", po::value<unsigned>()->default_value(1), "number of sentences decoded together at test time")
+        ("beam_size", po::value<unsigned>()->default_value(1), "beam width for decoding the test data and with --server or --socket; 1 decodes greedily")
+        ("threads", po::value<unsigned>()->default_value(1), "number of threads decoding the dev/test data and training (with lock-free Hogwild updates, unless --batch_size or --sync_updates is given)")
+        ("batch_size", po::value<unsigned>()->default_value(1), "number of training sentences whose gradients are summed into a single update (computed in parallel with --threads)")
+        ("sync_updates", "When training with several --threads, update once per batch of one sentence per thread instead of Hogwild updates (a --batch_size of --threads)")
         ("train,t", "Should training be run?")
-        ("words,w", po::value<string>(), "Pretrained word embeddings")
+        ("words,w", po::value<string>(), "Pretrained word embeddings (word2vec text format, or binary if the name ends in .bin)")
+        ("prune_pretrained", "Only keep the --words vectors of words in the training, dev and test data (decode with the --vocab written during training)")
+        ("server", "Parse CoNLL sentences read from stdin until end of input, writing the parses to stdout")
+        ("socket", po::value<string>(), "Parse CoNLL sentences sent to a Unix domain socket at this path")
         ("help,h", "Help");
   po::options_description dcmdline_options;
   dcmdline_options.add(opts);
@@ -83,8 +163,12 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     cerr << dcmdline_options << endl;
     exit(1);
   }
-  if (conf->count("training_data") == 0) {
-    cerr << "Please specify --traing_data (-T): this is required to determine the vocabulary mapping, even if the parser is used in prediction mode.\n";
+  if (conf->count("training_data") == 0 && (conf->count("vocab") == 0 || conf->count("train"))) {
+    cerr << "Please specify --traing_data (-T): this is required to determine the vocabulary mapping, unless a --vocab file written during training is used in prediction mode.\n";
+    exit(1);
+  }
+  if (conf->count("prune_pretrained") && conf->count("train") == 0) {
+    cerr << "--prune_pretrained changes the vocabulary, so it can only be used when training; decode with the --vocab file written then.\n";
     exit(1);
   }
 }
@@ -117,7 +201,7 @@ struct ParserBuilder {
   Parameters* p_buffer_guard;  // end of buffer
   Parameters* p_stack_guard;  // end of stack
 
-  explicit ParserBuilder(Model* model, const unordered_map<unsigned, vector<float>>& pretrained) :
+  explicit ParserBuilder(Model* model) :
       stack_lstm(LAYERS, LSTM_INPUT_DIM, HIDDEN_DIM, model),
       buffer_lstm(LAYERS, LSTM_INPUT_DIM, HIDDEN_DIM, model),
       action_lstm(LAYERS, ACTION_DIM, HIDDEN_DIM, model),
@@ -143,10 +227,8 @@ struct ParserBuilder {
       p_p = model->add_lookup_parameters(POS_SIZE, {POS_DIM});
       p_p2l = model->add_parameters({LSTM_INPUT_DIM, POS_DIM});
     }
-    if (pretrained.size() > 0) {
+    if (find(pretrained_vocab.begin(), pretrained_vocab.end(), true) != pretrained_vocab.end()) {
       p_t = model->add_lookup_parameters(VOCAB_SIZE, {PRETRAINED_DIM});
-      for (auto it : pretrained)
-        p_t->Initialize(it.first, it.second);
       p_t2l = model->add_parameters({LSTM_INPUT_DIM, PRETRAINED_DIM});
     } else {
       p_t = nullptr;
@@ -154,46 +236,57 @@ struct ParserBuilder {
     }
   }
 
-static bool IsActionForbidden(const string& a, unsigned bsize, unsigned ssize, const vector<int>& stacki) {
-  if (a[1]=='W' && ssize<3) return true;
-  if (a[1]=='W') {
-        int top=stacki[stacki.size()-1];
-        int sec=stacki[stacki.size()-2];
-        if (sec>top) return true;
-  }
-
-  bool is_shift = (a[0] == 'S' && a[1]=='H');
-  bool is_reduce = !is_shift;
-  if (is_shift && bsize == 1) return true;
-  if (is_reduce && ssize < 3) return true;
-  if (bsize == 2 && // ROOT is the only thing remaining on buffer
-      ssize > 2 && // there is more than a single element on the stack
-      is_shift) return true;
-  // only attach left to ROOT
-  if (bsize == 1 && ssize == 3 && a[0] == 'R') return true;
-  return false;
-}
+  // variables in the computation graph representing the parameters. they
+  // belong to the graph of the last new_graph call, which log_prob_parser
+  // and log_prob_parser_batch extend; a graph that is checkpointed right
+  // after new_graph can be reverted to parse the next sentence without
+  // adding the parameters again
+  Expression pbias, H, D, R, cbias, S, B, A, ib, w2l, p2l, t2l, p2a, abias;
+  Expression action_start, buffer_guard, stack_guard;
+
+  void new_graph(ComputationGraph& hg) {
+    stack_lstm.new_graph(hg);
+    buffer_lstm.new_graph(hg);
+    action_lstm.new_graph(hg);
+    pbias = parameter(hg, p_pbias);
+    H = parameter(hg, p_H);
+    D = parameter(hg, p_D);
+    R = parameter(hg, p_R);
+    cbias = parameter(hg, p_cbias);
+    S = parameter(hg, p_S);
+    B = parameter(hg, p_B);
+    A = parameter(hg, p_A);
+    ib = parameter(hg, p_ib);
+    w2l = parameter(hg, p_w2l);
+    if (USE_POS)
+      p2l = parameter(hg, p_p2l);
+    if (p_t2l)
+      t2l = parameter(hg, p_t2l);
+    p2a = parameter(hg, p_p2a);
+    abias = parameter(hg, p_abias);
+    action_start = parameter(hg, p_action_start);
+    buffer_guard = parameter(hg, p_buffer_guard);
+    stack_guard = parameter(hg, p_stack_guard);
+  }
 
 // take a vector of actions and return a parse tree (labeling of every
 // word position with its head's position)
-static map<int,int> compute_heads(unsigned sent_len, const vector<unsigned>& actions, const vector<string>& setOfActions, map<int,string>* pr = nullptr) {
-  map<int,int> heads;
-  map<int,string> r;
-  map<int,string>& rels = (pr ? *pr : r);
-  for(unsigned i=0;i<sent_len;i++) { heads[i]=-1; rels[i]="ERROR"; }
+static vector<int> compute_heads(unsigned sent_len, const vector<unsigned>& actions, vector<string>* pr = nullptr) {
+  vector<int> heads(sent_len, -1);
+  vector<string> r;
+  vector<string>& rels = (pr ? *pr : r);
+  rels.assign(sent_len, "ERROR");
   vector<int> bufferi(sent_len + 1, 0), stacki(1, -999);
   for (unsigned i = 0; i < sent_len; ++i)
     bufferi[sent_len - i] = i;
   bufferi[0] = -999;
   for (auto action: actions) { // loop over transitions for sentence
-    const string& actionString=setOfActions[action];
-    const char ac = actionString[0];
-    const char ac2 = actionString[1];
-    if (ac =='S' && ac2=='H') {  // SHIFT
+    const ActionKind kind = action_table.kind[action];
+    if (kind == SHIFT) {  // SHIFT
       assert(bufferi.size() > 1); // dummy symbol means > 1 (not >= 1)
       stacki.push_back(bufferi.back());
       bufferi.pop_back();
-    } else if (ac=='S' && ac2=='W') { // SWAP
+    } else if (kind == SWAP) { // SWAP
       assert(stacki.size() > 2);
       unsigned ii = 0, jj = 0;
       jj = stacki.back();
@@ -204,15 +297,15 @@ static map<int,int> compute_heads(unsigned sent_len, const vector<unsigned>& act
       stacki.push_back(jj);
     } else { // LEFT or RIGHT
       assert(stacki.size() > 2); // dummy symbol means > 2 (not >= 2)
-      assert(ac == 'L' || ac == 'R');
+      assert(kind == LEFT || kind == RIGHT);
       unsigned depi = 0, headi = 0;
-      (ac == 'R' ? depi : headi) = stacki.back();
+      (kind == RIGHT ? depi : headi) = stacki.back();
       stacki.pop_back();
-      (ac == 'R' ? headi : depi) = stacki.back();
+      (kind == RIGHT ? headi : depi) = stacki.back();
       stacki.pop_back();
       stacki.push_back(headi);
       heads[depi] = headi;
-      rels[depi] = actionString;
+      rels[depi] = action_table.rel_names[action_table.rel[action]];
     }
   }
   assert(bufferi.size() == 1);
@@ -226,43 +319,20 @@ static map<int,int> compute_heads(unsigned sent_len, const vector<unsigned>& act
 //               sent will have words replaced by appropriate UNK tokens
 // this lets us use pretrained embeddings, when available, for words that were OOV in the
 // parser training data
+// hg must be the graph of the last new_graph call
 vector<unsigned> log_prob_parser(ComputationGraph* hg,
                      const vector<unsigned>& raw_sent,  // raw sentence
                      const vector<unsigned>& sent,  // sent with oovs replaced
                      const vector<unsigned>& sentPos,
                      const vector<unsigned>& correct_actions,
-                     const vector<string>& setOfActions,
-                     const map<unsigned, std::string>& intToWords,
+                     const cpyp::StringTable& intToWords,
                      double *right) {
     vector<unsigned> results;
     const bool build_training_graph = correct_actions.size() > 0;
 
-    stack_lstm.new_graph(*hg);
-    buffer_lstm.new_graph(*hg);
-    action_lstm.new_graph(*hg);
     stack_lstm.start_new_sequence();
     buffer_lstm.start_new_sequence();
     action_lstm.start_new_sequence();
-    // variables in the computation graph representing the parameters
-    Expression pbias = parameter(*hg, p_pbias);
-    Expression H = parameter(*hg, p_H);
-    Expression D = parameter(*hg, p_D);
-    Expression R = parameter(*hg, p_R);
-    Expression cbias = parameter(*hg, p_cbias);
-    Expression S = parameter(*hg, p_S);
-    Expression B = parameter(*hg, p_B);
-    Expression A = parameter(*hg, p_A);
-    Expression ib = parameter(*hg, p_ib);
-    Expression w2l = parameter(*hg, p_w2l);
-    Expression p2l;
-    if (USE_POS)
-      p2l = parameter(*hg, p_p2l);
-    Expression t2l;
-    if (p_t2l)
-      t2l = parameter(*hg, p_t2l);
-    Expression p2a = parameter(*hg, p_p2a);
-    Expression abias = parameter(*hg, p_abias);
-    Expression action_start = parameter(*hg, p_action_start);
 
     action_lstm.add_input(action_start);
 
@@ -280,7 +350,7 @@ vector<unsigned> log_prob_parser(ComputationGraph* hg,
         args.push_back(p2l);
         args.push_back(p);
       }
-      if (p_t && pretrained.count(raw_sent[i])) {  // include fixed pretrained vectors?
+      if (p_t && pretrained_vocab[raw_sent[i]]) {  // include fixed pretrained vectors?
         Expression t = const_lookup(*hg, p_t, raw_sent[i]);
         args.push_back(t2l);
         args.push_back(t);
@@ -289,14 +359,13 @@ vector<unsigned> log_prob_parser(ComputationGraph* hg,
       bufferi[sent.size() - i] = i;
     }
     // dummy symbol to represent the empty buffer
-    buffer[0] = parameter(*hg, p_buffer_guard);
+    buffer[0] = buffer_guard;
     bufferi[0] = -999;
-    for (auto& b : buffer)
-      buffer_lstm.add_input(b);
+    buffer_lstm.add_inputs(buffer);
 
     vector<Expression> stack;  // variables representing subtree embeddings
     vector<int> stacki; // position of words in the sentence of head of subtree
-    stack.push_back(parameter(*hg, p_stack_guard));
+    stack.push_back(stack_guard);
     stacki.push_back(-999); // not used for anything
     // drive dummy symbol on stack through LSTM
     stack_lstm.add_input(stack.back());
@@ -305,12 +374,7 @@ vector<unsigned> log_prob_parser(ComputationGraph* hg,
     unsigned action_count = 0;  // incremented at each prediction
     while(stack.size() > 2 || buffer.size() > 1) {
       // get list of possible actions for the current parser state
-      vector<unsigned> current_valid_actions;
-      for (auto a: possible_actions) {
-        if (IsActionForbidden(setOfActions[a], buffer.size(), stack.size(), stacki))
-          continue;
-        current_valid_actions.push_back(a);
-      }
+      const vector<unsigned>& current_valid_actions = action_table.valid(buffer.size(), stack.size(), stacki);
 
       // p_t = pbias + S * slstm + B * blstm + A * almst
       Expression p_t = affine_transform({pbias, S, stack_lstm.back(), B, buffer_lstm.back(), A, action_lstm.back()});
@@ -318,24 +382,28 @@ vector<unsigned> log_prob_parser(ComputationGraph* hg,
       // r_t = abias + p2a * nlp
       Expression r_t = affine_transform({abias, p2a, nlp_t});
 
-      // adist = log_softmax(r_t, current_valid_actions)
-      Expression adiste = log_softmax(r_t, current_valid_actions);
-      vector<float> adist = as_vector(hg->incremental_forward());
-      double best_score = adist[current_valid_actions[0]];
       unsigned best_a = current_valid_actions[0];
-      for (unsigned i = 1; i < current_valid_actions.size(); ++i) {
-        if (adist[current_valid_actions[i]] > best_score) {
-          best_score = adist[current_valid_actions[i]];
-          best_a = current_valid_actions[i];
-        }
+      Expression adiste;
+      if (build_training_graph) {
+        // the loss needs adist = log_softmax(r_t, current_valid_actions)
+        // anyway, so the best valid action is read off it
+        adiste = log_softmax(r_t, current_valid_actions);
+        const float* adist = hg->incremental_forward(adiste).v;
+        for (unsigned i = 1; i < current_valid_actions.size(); ++i)
+          if (adist[current_valid_actions[i]] > adist[best_a])
+            best_a = current_valid_actions[i];
+      } else {
+        // the log_softmax does not change which valid action scores best, so
+        // decoding only evaluates the raw scores and their masked argmax
+        best_a = hg->incremental_forward(masked_argmax(r_t, current_valid_actions)).v[0];
       }
       unsigned action = best_a;
       if (build_training_graph) {  // if we have reference actions (for training) use the reference action
         action = correct_actions[action_count];
         if (best_a == action) { (*right)++; }
+        log_probs.push_back(pick(adiste, action));
       }
       ++action_count;
-      log_probs.push_back(pick(adiste, action));
       results.push_back(action);
 
       // add current action to action LSTM
@@ -346,12 +414,10 @@ vector<unsigned> log_prob_parser(ComputationGraph* hg,
       Expression relation = lookup(*hg, p_r, action);
 
       // do action
-      const string& actionString=setOfActions[action];
-      const char ac = actionString[0];
-      const char ac2 = actionString[1];
+      const ActionKind kind = action_table.kind[action];
 
 
-      if (ac =='S' && ac2=='H') {  // SHIFT
+      if (kind == SHIFT) {  // SHIFT
         assert(buffer.size() > 1); // dummy symbol means > 1 (not >= 1)
         stack.push_back(buffer.back());
         stack_lstm.add_input(buffer.back());
@@ -359,7 +425,7 @@ vector<unsigned> log_prob_parser(ComputationGraph* hg,
         buffer_lstm.rewind_one_step();
         stacki.push_back(bufferi.back());
         bufferi.pop_back();
-      } else if (ac=='S' && ac2=='W'){ //SWAP --- Miguel
+      } else if (kind == SWAP){ //SWAP --- Miguel
         assert(stack.size() > 2); // dummy symbol means > 2 (not >= 2)
 
         Expression toki, tokj;
@@ -388,18 +454,18 @@ vector<unsigned> log_prob_parser(ComputationGraph* hg,
         stack_lstm.add_input(stack.back());
       } else { // LEFT or RIGHT
         assert(stack.size() > 2); // dummy symbol means > 2 (not >= 2)
-        assert(ac == 'L' || ac == 'R');
+        assert(kind == LEFT || kind == RIGHT);
         Expression dep, head;
         unsigned depi = 0, headi = 0;
-        (ac == 'R' ? dep : head) = stack.back();
-        (ac == 'R' ? depi : headi) = stacki.back();
+        (kind == RIGHT ? dep : head) = stack.back();
+        (kind == RIGHT ? depi : headi) = stacki.back();
         stack.pop_back();
         stacki.pop_back();
-        (ac == 'R' ? head : dep) = stack.back();
-        (ac == 'R' ? headi : depi) = stacki.back();
+        (kind == RIGHT ? head : dep) = stack.back();
+        (kind == RIGHT ? headi : depi) = stacki.back();
         stack.pop_back();
         stacki.pop_back();
-        if (headi == sent.size() - 1) rootword = intToWords.find(sent[depi])->second;
+        if (headi == sent.size() - 1) rootword = intToWords[sent[depi]];
         // composed = cbias + H * head + D * dep + R * relation
         Expression composed = affine_transform({cbias, H, head, D, dep, R, relation});
         Expression nlcomposed = tanh(composed);
@@ -414,10 +480,600 @@ vector<unsigned> log_prob_parser(ComputationGraph* hg,
     assert(stacki.size() == 2);
     assert(buffer.size() == 1); // guard symbol
     assert(bufferi.size() == 1);
-    Expression tot_neglogprob = -sum(log_probs);
-    assert(tot_neglogprob.pg != nullptr);
+    if (build_training_graph) {
+      Expression tot_neglogprob = -sum(log_probs);
+      assert(tot_neglogprob.pg != nullptr);
+    }
+    return results;
+  }
+
+  // greedy decoding of several sentences at once. all sentences advance in
+  // lockstep: at each step the parser states of the unfinished sentences are
+  // scored as one minibatch and the stack, buffer and action LSTMs are
+  // extended with a single batched step each, so the hot loop runs GEMMs
+  // instead of matrix-vector products. returns the actions chosen for each
+  // sentence. they are those of log_prob_parser up to floating-point
+  // rounding: the GEMMs can round differently from the matrix-vector
+  // products, so a near-tie between two actions can go the other way. hg
+  // must be the graph of the last new_graph call.
+  vector<vector<unsigned>> log_prob_parser_batch(ComputationGraph* hg,
+                     const vector<vector<unsigned>>& raw_sents,  // raw sentences
+                     const vector<vector<unsigned>>& sents,  // sents with oovs replaced
+                     const vector<vector<unsigned>>& sentsPos) {
+    const unsigned N = sents.size();
+    assert(raw_sents.size() == N && sentsPos.size() == N);
+
+    stack_lstm.start_new_sequence();
+    buffer_lstm.start_new_sequence();
+    action_lstm.start_new_sequence();
+
+    // the initial action and stack states are the same for every sentence
+    action_lstm.add_input(action_start);
+    const RNNPointer action_start_state = action_lstm.state();
+    stack_lstm.add_input(stack_guard);
+    const RNNPointer stack_guard_state = stack_lstm.state();
+    // dummy symbol to represent the empty buffer
+    buffer_lstm.add_input(buffer_guard);
+    const RNNPointer buffer_guard_state = buffer_lstm.state();
+
+    struct State {
+      vector<Expression> buffer;  // word embeddings (possibly including POS info)
+      vector<int> bufferi;  // position of the words in the sentence
+      vector<Expression> stack;  // subtree embeddings
+      vector<int> stacki;  // position of the head of each subtree
+      RNNPointer buffer_state, stack_state, action_state;
+      vector<unsigned> results;
+    };
+    vector<State> states(N);
+    unsigned max_len = 0;
+    for (unsigned k = 0; k < N; ++k) {
+      State& st = states[k];
+      st.buffer.resize(sents[k].size() + 1);
+      st.bufferi.resize(sents[k].size() + 1);
+      st.buffer[0] = buffer_guard;
+      st.bufferi[0] = -999;
+      st.buffer_state = buffer_guard_state;
+      st.stack.push_back(stack_guard);
+      st.stacki.push_back(-999); // not used for anything
+      st.stack_state = stack_guard_state;
+      st.action_state = action_start_state;
+      max_len = max<unsigned>(max_len, sents[k].size());
+    }
+
+    // precompute the buffer representations; position j of the buffer holds
+    // the j-th word from the end of the sentence, and is computed for all
+    // sentences that are at least j words long in one batch
+    Expression zero_t;
+    for (unsigned j = 1; j <= max_len; ++j) {
+      vector<unsigned> active, words, tags;
+      vector<Expression> ts;
+      bool any_pretrained = false;
+      for (unsigned k = 0; k < N; ++k) {
+        if (sents[k].size() < j) continue;
+        const unsigned i = sents[k].size() - j;
+        assert(sents[k][i] < VOCAB_SIZE);
+        active.push_back(k);
+        words.push_back(sents[k][i]);
+        if (USE_POS) tags.push_back(sentsPos[k][i]);
+        if (p_t) {
+          // a word without a pretrained vector contributes nothing to the
+          // affine transform, same as leaving the term out
+          if (pretrained_vocab[raw_sents[k][i]]) {
+            ts.push_back(const_lookup(*hg, p_t, raw_sents[k][i]));
+            any_pretrained = true;
+          } else {
+            if (!zero_t.pg) zero_t = zeroes(*hg, {PRETRAINED_DIM});
+            ts.push_back(zero_t);
+          }
+        }
+      }
+      vector<Expression> args = {ib, w2l, lookup(*hg, p_w, words)}; // learn embeddings
+      if (USE_POS) { // learn POS tag?
+        args.push_back(p2l);
+        args.push_back(lookup(*hg, p_p, tags));
+      }
+      if (any_pretrained) {  // include fixed pretrained vectors?
+        args.push_back(t2l);
+        args.push_back(concatenate_to_batch(ts));
+      }
+      Expression e = rectify(affine_transform(args));
+      vector<RNNPointer> prev(active.size());
+      vector<Expression> xs(active.size());
+      for (unsigned a = 0; a < active.size(); ++a) {
+        State& st = states[active[a]];
+        xs[a] = st.buffer[j] = (active.size() == 1 ? e : pick_batch_elem(e, a));
+        st.bufferi[j] = sents[active[a]].size() - j;
+        prev[a] = st.buffer_state;
+      }
+      vector<RNNPointer> next = buffer_lstm.add_input_batch(prev, xs);
+      for (unsigned a = 0; a < active.size(); ++a)
+        states[active[a]].buffer_state = next[a];
+    }
+
+    while (true) {
+      vector<unsigned> active;
+      for (unsigned k = 0; k < N; ++k)
+        if (states[k].stack.size() > 2 || states[k].buffer.size() > 1)
+          active.push_back(k);
+      if (active.empty()) break;
+      const unsigned K = active.size();
+
+      // p_t = pbias + S * slstm + B * blstm + A * almst
+      vector<Expression> sh(K), bh(K), ah(K);
+      for (unsigned a = 0; a < K; ++a) {
+        const State& st = states[active[a]];
+        sh[a] = stack_lstm.get_h(st.stack_state).back();
+        bh[a] = buffer_lstm.get_h(st.buffer_state).back();
+        ah[a] = action_lstm.get_h(st.action_state).back();
+      }
+      Expression p_t = affine_transform({pbias, S, concatenate_to_batch(sh), B, concatenate_to_batch(bh), A, concatenate_to_batch(ah)});
+      Expression nlp_t = rectify(p_t);
+      // r_t = abias + p2a * nlp
+      Expression r_t = affine_transform({abias, p2a, nlp_t});
+      // log_softmax over the valid actions does not change which of them
+      // scores best, so the raw scores are enough for greedy decoding
+      hg->incremental_forward();
+      const Tensor& scores = r_t.value();
+
+      vector<Expression> action_inputs(K), stack_inputs(K), heads, deps, relations;
+      vector<unsigned> reducing;
+      vector<RNNPointer> action_prev(K), stack_prev(K), buffer_prev;
+      vector<Expression> buffer_inputs;
+      vector<unsigned> swapping;
+      for (unsigned a = 0; a < K; ++a) {
+        State& st = states[active[a]];
+        const float* adist = scores.batch_ptr(a);
+        const vector<unsigned>& valid = action_table.valid(st.buffer.size(), st.stack.size(), st.stacki);
+        assert(valid.size() > 0);
+        unsigned action = valid[0];
+        for (auto act: valid)
+          if (adist[act] > adist[action]) action = act;
+        st.results.push_back(action);
+        action_prev[a] = st.action_state;
+        action_inputs[a] = lookup(*hg, p_a, action);
+
+        // do action
+        const ActionKind kind = action_table.kind[action];
+        if (kind == SHIFT) {  // SHIFT
+          assert(st.buffer.size() > 1); // dummy symbol means > 1 (not >= 1)
+          stack_inputs[a] = st.buffer.back();
+          st.stack.push_back(st.buffer.back());
+          st.buffer.pop_back();
+          st.buffer_state = buffer_lstm.get_head(st.buffer_state);
+          st.stacki.push_back(st.bufferi.back());
+          st.bufferi.pop_back();
+        } else if (kind == SWAP) { // SWAP
+          assert(st.stack.size() > 2); // dummy symbol means > 2 (not >= 2)
+          Expression tokj = st.stack.back();
+          int jj = st.stacki.back();
+          st.stack.pop_back();
+          st.stacki.pop_back();
+          st.buffer.push_back(st.stack.back());
+          st.bufferi.push_back(st.stacki.back());
+          st.stack.pop_back();
+          st.stacki.pop_back();
+          st.stack_state = stack_lstm.get_head(stack_lstm.get_head(st.stack_state));
+          swapping.push_back(active[a]);
+          buffer_prev.push_back(st.buffer_state);
+          buffer_inputs.push_back(st.buffer.back());
+          stack_inputs[a] = tokj;
+          st.stack.push_back(tokj);
+          st.stacki.push_back(jj);
+        } else { // LEFT or RIGHT
+          assert(st.stack.size() > 2); // dummy symbol means > 2 (not >= 2)
+          assert(kind == LEFT || kind == RIGHT);
+          Expression dep, head;
+          unsigned depi = 0, headi = 0;
+          (kind == RIGHT ? dep : head) = st.stack.back();
+          (kind == RIGHT ? depi : headi) = st.stacki.back();
+          st.stack.pop_back();
+          st.stacki.pop_back();
+          (kind == RIGHT ? head : dep) = st.stack.back();
+          (kind == RIGHT ? headi : depi) = st.stacki.back();
+          st.stack.pop_back();
+          st.stacki.pop_back();
+          st.stack_state = stack_lstm.get_head(stack_lstm.get_head(st.stack_state));
+          reducing.push_back(a);
+          heads.push_back(head);
+          deps.push_back(dep);
+          relations.push_back(lookup(*hg, p_r, action));
+          st.stacki.push_back(headi);
+        }
+        stack_prev[a] = st.stack_state;
+      }
+
+      if (reducing.size()) {
+        // composed = cbias + H * head + D * dep + R * relation
+        Expression composed = affine_transform({cbias, H, concatenate_to_batch(heads), D, concatenate_to_batch(deps), R, concatenate_to_batch(relations)});
+        Expression nlcomposed = tanh(composed);
+        for (unsigned r = 0; r < reducing.size(); ++r) {
+          const unsigned a = reducing[r];
+          stack_inputs[a] = (reducing.size() == 1 ? nlcomposed : pick_batch_elem(nlcomposed, r));
+          states[active[a]].stack.push_back(stack_inputs[a]);
+        }
+      }
+      if (swapping.size()) {
+        vector<RNNPointer> next = buffer_lstm.add_input_batch(buffer_prev, buffer_inputs);
+        for (unsigned w = 0; w < swapping.size(); ++w)
+          states[swapping[w]].buffer_state = next[w];
+      }
+      vector<RNNPointer> next_action = action_lstm.add_input_batch(action_prev, action_inputs);
+      vector<RNNPointer> next_stack = stack_lstm.add_input_batch(stack_prev, stack_inputs);
+      for (unsigned a = 0; a < K; ++a) {
+        states[active[a]].action_state = next_action[a];
+        states[active[a]].stack_state = next_stack[a];
+      }
+    }
+    vector<vector<unsigned>> results(N);
+    for (unsigned k = 0; k < N; ++k) {
+      assert(states[k].stack.size() == 2); // guard symbol, root
+      assert(states[k].buffer.size() == 1); // guard symbol
+      results[k].swap(states[k].results);
+    }
+    return results;
+  }
+};
+
+// decoding without a ComputationGraph, for parsing at test time. the
+// parameters are applied with the same Eigen kernels as the graph nodes, so
+// the greedy parses are those of log_prob_parser, but the token and subtree
+// vectors and the LSTM states are kept in an arena that is reused from one
+// sentence to the next, so after the first few sentences nothing is
+// allocated. the arena may grow, so vectors are referred to by their offset
+// in it.
+struct Decoder {
+  explicit Decoder(const ParserBuilder& parser) : parser(parser) {}
+
+  // greedy decoding
+  vector<unsigned> parse(const vector<unsigned>& raw_sent,  // raw sentence
+                         const vector<unsigned>& sent,  // sent with oovs replaced
+                         const vector<unsigned>& sentPos) {
+    const ParserBuilder& p = parser;
+    vector<unsigned> results;
+    start(raw_sent, sent, sentPos);
+    while (stack.size() > 2 || buffer.size() > 1) {
+      score(stack_state.back(), buffer_state.back(), action_state);
+      const vector<unsigned>& valid = action_table.valid(buffer.size(), stack.size(), stacki);
+      assert(valid.size() > 0);
+      unsigned action = valid[0];
+      for (auto a: valid)
+        if (scores[a] > scores[action]) action = a;
+      results.push_back(action);
+
+      // add current action to action LSTM
+      action_state = push_action(action_state, action);
+
+      // do action
+      const ActionKind kind = action_table.kind[action];
+      if (kind == SHIFT) {  // SHIFT
+        assert(buffer.size() > 1); // dummy symbol means > 1 (not >= 1)
+        push(stack, stack_state, p.stack_lstm, buffer.back());
+        stacki.push_back(bufferi.back());
+        buffer.pop_back();
+        buffer_state.pop_back();
+        bufferi.pop_back();
+      } else if (kind == SWAP) { // SWAP
+        assert(stack.size() > 2); // dummy symbol means > 2 (not >= 2)
+        const unsigned tokj = stack.back();
+        const int jj = stacki.back();
+        stack.pop_back();
+        stack_state.pop_back();
+        stacki.pop_back();
+        push(buffer, buffer_state, p.buffer_lstm, stack.back());
+        bufferi.push_back(stacki.back());
+        stack.pop_back();
+        stack_state.pop_back();
+        stacki.pop_back();
+        push(stack, stack_state, p.stack_lstm, tokj);
+        stacki.push_back(jj);
+      } else { // LEFT or RIGHT
+        assert(stack.size() > 2); // dummy symbol means > 2 (not >= 2)
+        assert(kind == LEFT || kind == RIGHT);
+        unsigned dep = 0, head = 0;
+        int depi = 0, headi = 0;
+        (kind == RIGHT ? dep : head) = stack.back();
+        (kind == RIGHT ? depi : headi) = stacki.back();
+        stack.pop_back();
+        stack_state.pop_back();
+        stacki.pop_back();
+        (kind == RIGHT ? head : dep) = stack.back();
+        (kind == RIGHT ? headi : depi) = stacki.back();
+        stack.pop_back();
+        stack_state.pop_back();
+        stacki.pop_back();
+        push(stack, stack_state, p.stack_lstm, compose(head, dep, action));
+        stacki.push_back(headi);
+      }
+    }
+    assert(stack.size() == 2); // guard symbol, root
+    assert(buffer.size() == 1); // guard symbol
     return results;
   }
+
+  // beam search, keeping the width best partial parses by the sum of the
+  // log probabilities of their actions. a parse shares its stack, buffer and
+  // action history with the parse it extends, LSTM states included, and only
+  // adds what its last action pushed. the parser states of the whole beam
+  // are scored as one minibatch. search stops as soon as the best parse in
+  // the beam is complete, since further actions can only lower a score.
+  vector<unsigned> parse_beam(const vector<unsigned>& raw_sent,  // raw sentence
+                              const vector<unsigned>& sent,  // sent with oovs replaced
+                              const vector<unsigned>& sentPos,
+                              unsigned width) {
+    const ParserBuilder& p = parser;
+    const unsigned n = sent.size();
+    start(raw_sent, sent, sentPos);
+    // the stacks and buffers of the beam are linked lists of cells, each
+    // holding an element and the LSTM state after reading it
+    cells.clear();
+    for (unsigned j = 0; j <= n; ++j)
+      cells.push_back({buffer[j], bufferi[j], buffer_state[j], int(j) - 1});
+    cells.push_back({stack[0], stacki[0], stack_state[0], -1});
+    history.clear();
+    beam.assign(1, {0., int(n) + 1, int(n), 1, n + 1, action_state, -1});
+    while (!beam[0].complete()) {
+      const unsigned K = beam.size();
+      // p_t = pbias + S * slstm + B * blstm + A * almst, for the whole beam
+      hs.resize(3 * HIDDEN_DIM * K);
+      Eigen::Map<Eigen::MatrixXf> sh(hs.data(), HIDDEN_DIM, K), bh(sh.data() + HIDDEN_DIM * K, HIDDEN_DIM, K),
+          ah(bh.data() + HIDDEN_DIM * K, HIDDEN_DIM, K);
+      for (unsigned k = 0; k < K; ++k) {
+        const Hypothesis& h = beam[k];
+        memcpy(&sh(0, k), p.stack_lstm.state_h(at(cells[h.stack].state)), HIDDEN_DIM * sizeof(float));
+        memcpy(&bh(0, k), p.buffer_lstm.state_h(at(cells[h.buffer].state)), HIDDEN_DIM * sizeof(float));
+        memcpy(&ah(0, k), p.action_lstm.state_h(at(h.action_state)), HIDDEN_DIM * sizeof(float));
+      }
+      hidden.resize(HIDDEN_DIM * K);
+      Eigen::Map<Eigen::MatrixXf> nlp(hidden.data(), HIDDEN_DIM, K);
+      nlp.colwise() = p.p_pbias->values.vec();
+      nlp.noalias() += *p.p_S->values * sh;
+      nlp.noalias() += *p.p_B->values * bh;
+      nlp.noalias() += *p.p_A->values * ah;
+      nlp = nlp.cwiseMax(0.f);
+      // r_t = abias + p2a * nlp
+      scores.resize(ACTION_SIZE * K);
+      Eigen::Map<Eigen::MatrixXf> r(scores.data(), ACTION_SIZE, K);
+      r.colwise() = p.p_abias->values.vec();
+      r.noalias() += *p.p_p2a->values * nlp;
+
+      // complete parses stay in the beam as they are
+      candidates.clear();
+      for (unsigned k = 0; k < K; ++k) {
+        const Hypothesis& h = beam[k];
+        if (h.complete()) {
+          candidates.push_back({h.score, k, -1});
+          continue;
+        }
+        const float* rk = &r(0, k);
+        stacki.clear();
+        if (h.stack_size > 1) stacki.push_back(cells[cells[h.stack].next].i);
+        stacki.push_back(cells[h.stack].i);
+        const unsigned first = candidates.size();
+        float max_score = -numeric_limits<float>::infinity();
+        for (auto a: action_table.valid(h.buffer_size, h.stack_size, stacki)) {
+          max_score = max(max_score, rk[a]);
+          candidates.push_back({0., k, int(a)});
+        }
+        assert(candidates.size() > first);
+        // log_softmax over the valid actions
+        double z = 0;
+        for (unsigned c = first; c < candidates.size(); ++c)
+          z += exp(rk[candidates[c].action] - max_score);
+        const double log_z = max_score + log(z);
+        for (unsigned c = first; c < candidates.size(); ++c)
+          candidates[c].score = h.score + rk[candidates[c].action] - log_z;
+      }
+      const unsigned kept = min<unsigned>(width, candidates.size());
+      // ties go to the candidate found first, so the search is deterministic
+      partial_sort(candidates.begin(), candidates.begin() + kept, candidates.end(),
+                   [](const Candidate& a, const Candidate& b) {
+                     return a.score > b.score || (a.score == b.score && (a.k < b.k || (a.k == b.k && a.action < b.action)));
+                   });
+      next_beam.clear();
+      for (unsigned c = 0; c < kept; ++c) {
+        const Candidate& cand = candidates[c];
+        if (cand.action < 0)
+          next_beam.push_back(beam[cand.k]);
+        else
+          next_beam.push_back(extend(beam[cand.k], cand.action, cand.score));
+      }
+      beam.swap(next_beam);
+    }
+    vector<unsigned> results;
+    for (int e = beam[0].history; e >= 0; e = history[e].second)
+      results.push_back(history[e].first);
+    reverse(results.begin(), results.end());
+    return results;
+  }
+
+ private:
+  struct Cell {
+    unsigned x;  // offset of the token or subtree embedding
+    int i;  // position of the word or of the head of the subtree
+    unsigned state;  // offset of the LSTM state after reading x
+    int next;  // the cell below, or -1
+  };
+  struct Hypothesis {
+    double score;
+    int stack, buffer;  // top cells
+    unsigned stack_size, buffer_size;  // including the guard symbols
+    unsigned action_state;
+    int history;  // last entry of the action history, or -1
+    bool complete() const { return stack_size <= 2 && buffer_size <= 1; }
+  };
+  struct Candidate {
+    double score;
+    unsigned k;  // hypothesis extended
+    int action;  // or -1 to keep a complete hypothesis
+  };
+
+  // computes the token representations, reads them into the buffer LSTM and
+  // starts the stack and action LSTMs
+  void start(const vector<unsigned>& raw_sent, const vector<unsigned>& sent,
+             const vector<unsigned>& sentPos) {
+    const ParserBuilder& p = parser;
+    const unsigned n = sent.size();
+    arena.clear();
+    const unsigned scratch_size = max(p.buffer_lstm.scratch_size(n + 1),
+                                      max(p.stack_lstm.scratch_size(), p.action_lstm.scratch_size()));
+    if (scratch.size() < scratch_size) scratch.resize(scratch_size);
+
+    action_state = alloc(p.action_lstm.state_size());
+    p.action_lstm.step(nullptr, p.p_action_start->values.v, at(action_state), scratch.data());
+
+    buffer.resize(n + 1);  // word embeddings (possibly including POS info)
+    bufferi.resize(n + 1);  // position of the words in the sentence
+    for (unsigned i = 0; i < n; ++i) {
+      assert(sent[i] < VOCAB_SIZE);
+      const unsigned x = buffer[n - i] = alloc(LSTM_INPUT_DIM);
+      bias(at(x), p.p_ib);
+      accumulate(at(x), p.p_w2l, p.p_w->values[sent[i]].v);
+      if (USE_POS)
+        accumulate(at(x), p.p_p2l, p.p_p->values[sentPos[i]].v);
+      if (p.p_t && pretrained_vocab[raw_sent[i]])
+        accumulate(at(x), p.p_t2l, p.p_t->values[raw_sent[i]].v);
+      rectify(at(x), LSTM_INPUT_DIM);
+      bufferi[n - i] = i;
+    }
+    // dummy symbol to represent the empty buffer
+    buffer[0] = copy(p.p_buffer_guard);
+    bufferi[0] = -999;
+    buffer_state.resize(n + 1);
+    for (auto& s : buffer_state) s = alloc(p.buffer_lstm.state_size());
+    xs.resize(n + 1);
+    states.resize(n + 1);
+    for (unsigned j = 0; j <= n; ++j) {
+      xs[j] = at(buffer[j]);
+      states[j] = at(buffer_state[j]);
+    }
+    p.buffer_lstm.steps(nullptr, xs, states, scratch.data());
+
+    stack.assign(1, copy(p.p_stack_guard));  // subtree embeddings
+    stacki.assign(1, -999);  // position of the head of each subtree
+    stack_state.assign(1, alloc(p.stack_lstm.state_size()));
+    p.stack_lstm.step(nullptr, at(stack[0]), at(stack_state[0]), scratch.data());
+  }
+
+  // scores the actions for one parser state
+  void score(unsigned stack_state, unsigned buffer_state, unsigned action_state) {
+    const ParserBuilder& p = parser;
+    // p_t = pbias + S * slstm + B * blstm + A * almst
+    hidden.resize(HIDDEN_DIM);
+    bias(hidden.data(), p.p_pbias);
+    accumulate(hidden.data(), p.p_S, p.stack_lstm.state_h(at(stack_state)));
+    accumulate(hidden.data(), p.p_B, p.buffer_lstm.state_h(at(buffer_state)));
+    accumulate(hidden.data(), p.p_A, p.action_lstm.state_h(at(action_state)));
+    rectify(hidden.data(), HIDDEN_DIM);
+    // r_t = abias + p2a * nlp; the log_softmax over the valid actions does
+    // not change which of them scores best
+    scores.resize(ACTION_SIZE);
+    bias(scores.data(), p.p_abias);
+    accumulate(scores.data(), p.p_p2a, hidden.data());
+  }
+
+  // applies action to h, which has been given the score of the result
+  Hypothesis extend(const Hypothesis& h, unsigned action, double score) {
+    const ParserBuilder& p = parser;
+    Hypothesis e = h;
+    e.score = score;
+    e.history = history.size();
+    history.push_back({action, h.history});
+    e.action_state = push_action(h.action_state, action);
+    const ActionKind kind = action_table.kind[action];
+    if (kind == SHIFT) {  // SHIFT
+      assert(e.buffer_size > 1); // dummy symbol means > 1 (not >= 1)
+      const Cell b = cells[e.buffer];
+      e.buffer = b.next;
+      --e.buffer_size;
+      push(e.stack, e.stack_size, p.stack_lstm, b.x, b.i);
+    } else {
+      assert(e.stack_size > 2); // dummy symbol means > 2 (not >= 2)
+      const Cell top = cells[e.stack], sec = cells[top.next];
+      e.stack = sec.next;
+      e.stack_size -= 2;
+      if (kind == SWAP) { // SWAP
+        push(e.buffer, e.buffer_size, p.buffer_lstm, sec.x, sec.i);
+        push(e.stack, e.stack_size, p.stack_lstm, top.x, top.i);
+      } else { // LEFT or RIGHT
+        assert(kind == LEFT || kind == RIGHT);
+        const Cell& head = (kind == RIGHT ? sec : top);
+        const Cell& dep = (kind == RIGHT ? top : sec);
+        push(e.stack, e.stack_size, p.stack_lstm, compose(head.x, dep.x, action), head.i);
+      }
+    }
+    return e;
+  }
+
+  // every vector starts on a 32-byte boundary, as in the graph's memory
+  // pools, so that the vectorized kernels round exactly as they do there
+  unsigned alloc(unsigned size) {
+    const unsigned offset = arena.size();
+    arena.resize(offset + ((size + 7) & ~7u));
+    return offset;
+  }
+  float* at(unsigned offset) { return arena.data() + offset; }
+  unsigned copy(const Parameters* x) {
+    const unsigned offset = alloc(x->dim.size());
+    memcpy(at(offset), x->values.v, x->dim.size() * sizeof(float));
+    return offset;
+  }
+  // y = b and y += W * x, as computed by affine_transform
+  static void bias(float* y, const Parameters* b) {
+    Eigen::Map<Eigen::MatrixXf>(y, b->dim.rows(), 1) = b->values.batch_matrix(0);
+  }
+  static void accumulate(float* y, const Parameters* W, const float* x) {
+    Eigen::Map<Eigen::MatrixXf>(y, W->dim.rows(), 1).noalias() +=
+        *W->values * Eigen::Map<Eigen::MatrixXf>(const_cast<float*>(x), W->dim.cols(), 1);
+  }
+  static void rectify(float* y, unsigned n) {
+    Eigen::Map<Eigen::VectorXf> v(y, n);
+    v = v.cwiseMax(0.f);
+  }
+  // composed = tanh(cbias + H * head + D * dep + R * relation)
+  unsigned compose(unsigned head, unsigned dep, unsigned action) {
+    const ParserBuilder& p = parser;
+    const unsigned composed = alloc(LSTM_INPUT_DIM);
+    bias(at(composed), p.p_cbias);
+    accumulate(at(composed), p.p_H, at(head));
+    accumulate(at(composed), p.p_D, at(dep));
+    accumulate(at(composed), p.p_R, p.p_r->values[action].v);
+    Eigen::Map<Eigen::VectorXf> nlcomposed(at(composed), LSTM_INPUT_DIM);
+    nlcomposed.array() = nlcomposed.array().tanh();
+    return composed;
+  }
+  // returns the state of the action LSTM after reading action
+  unsigned push_action(unsigned prev, unsigned action) {
+    const unsigned state = alloc(parser.action_lstm.state_size());
+    parser.action_lstm.step(at(prev), parser.p_a->values[action].v, at(state), scratch.data());
+    return state;
+  }
+  // pushes x and the state of lstm after reading it onto a stack or buffer
+  void push(vector<unsigned>& xs, vector<unsigned>& xs_state, const LSTMBuilder& lstm, unsigned x) {
+    const unsigned state = alloc(lstm.state_size());
+    lstm.step(at(xs_state.back()), at(x), at(state), scratch.data());
+    xs.push_back(x);
+    xs_state.push_back(state);
+  }
+  // the same for the linked lists of beam search
+  void push(int& top, unsigned& size, const LSTMBuilder& lstm, unsigned x, int i) {
+    const unsigned state = alloc(lstm.state_size());
+    lstm.step(at(cells[top].state), at(x), at(state), scratch.data());
+    cells.push_back({x, i, state, top});
+    top = cells.size() - 1;
+    ++size;
+  }
+
+  const ParserBuilder& parser;
+  vector<float, Eigen::aligned_allocator<float>> arena, scratch, hidden, scores, hs;
+  vector<unsigned> buffer, stack, buffer_state, stack_state;
+  vector<int> bufferi, stacki;
+  unsigned action_state;
+  vector<const float*> xs;
+  vector<float*> states;
+  vector<Cell> cells;
+  vector<pair<unsigned, int>> history;  // action and previous entry
+  vector<Hypothesis> beam, next_beam;
+  vector<Candidate> candidates;
 };
 
 void signal_callback_handler(int /* signum */) {
@@ -429,23 +1085,21 @@ void signal_callback_handler(int /* signum */) {
   requested_stop = true;
 }
 
-unsigned compute_correct(const map<int,int>& ref, const map<int,int>& hyp, unsigned len) {
+unsigned compute_correct(const vector<int>& ref, const vector<int>& hyp, unsigned len) {
+  assert(ref.size() >= len && hyp.size() >= len);
   unsigned res = 0;
-  for (unsigned i = 0; i < len; ++i) {
-    auto ri = ref.find(i);
-    auto hi = hyp.find(i);
-    assert(ri != ref.end());
-    assert(hi != hyp.end());
-    if (ri->second == hi->second) ++res;
-  }
+  for (unsigned i = 0; i < len; ++i)
+    if (ref[i] == hyp[i]) ++res;
   return res;
 }
 
-void output_conll(const vector<unsigned>& sentence, const vector<unsigned>& pos,
+void output_conll(ostream& out,
+                  const vector<unsigned>& sentence, const vector<unsigned>& pos,
                   const vector<string>& sentenceUnkStrings, 
-                  const map<unsigned, string>& intToWords, 
-                  const map<unsigned, string>& intToPos, 
-                  const map<int,int>& hyp, const map<int,string>& rel_hyp) {
+                  const cpyp::StringTable& intToWords, 
+                  const cpyp::StringTable& intToPos, 
+                  const vector<int>& hyp, const vector<string>& rel_hyp,
+                  const vector<string>* posUnkStrings = nullptr) {
   for (unsigned i = 0; i < (sentence.size()-1); ++i) {
     auto index = i + 1;
     assert(i < sentenceUnkStrings.size() && 
@@ -453,31 +1107,124 @@ void output_conll(const vector<unsigned>& sentence, const vector<unsigned>& pos,
              sentenceUnkStrings[i].size() > 0) ||
             (sentence[i] != corpus.get_or_add_word(cpyp::Corpus::UNK) &&
              sentenceUnkStrings[i].size() == 0 &&
-             intToWords.find(sentence[i]) != intToWords.end())));
+             intToWords.contains(sentence[i]))));
     string wit = (sentenceUnkStrings[i].size() > 0)? 
-      sentenceUnkStrings[i] : intToWords.find(sentence[i])->second;
-    auto pit = intToPos.find(pos[i]);
-    assert(hyp.find(i) != hyp.end());
-    auto hyp_head = hyp.find(i)->second + 1;
+      sentenceUnkStrings[i] : intToWords[sentence[i]];
+    string pit;
+    if (posUnkStrings && (*posUnkStrings)[i].size() > 0) {
+      pit = (*posUnkStrings)[i];
+    } else {
+      assert(intToPos.contains(pos[i]));
+      pit = intToPos[pos[i]];
+    }
+    assert(i < hyp.size());
+    auto hyp_head = hyp[i] + 1;
     if (hyp_head == (int)sentence.size()) hyp_head = 0;
-    auto hyp_rel_it = rel_hyp.find(i);
-    assert(hyp_rel_it != rel_hyp.end());
-    auto hyp_rel = hyp_rel_it->second;
-    size_t first_char_in_rel = hyp_rel.find('(') + 1;
-    size_t last_char_in_rel = hyp_rel.rfind(')') - 1;
-    hyp_rel = hyp_rel.substr(first_char_in_rel, last_char_in_rel - first_char_in_rel + 1);
-    cout << index << '\t'       // 1. ID 
-         << wit << '\t'         // 2. FORM
-         << "_" << '\t'         // 3. LEMMA 
-         << "_" << '\t'         // 4. CPOSTAG 
-         << pit->second << '\t' // 5. POSTAG
-         << "_" << '\t'         // 6. FEATS
-         << hyp_head << '\t'    // 7. HEAD
-         << hyp_rel << '\t'     // 8. DEPREL
-         << "_" << '\t'         // 9. PHEAD
-         << "_" << endl;        // 10. PDEPREL
-  }
-  cout << endl;
+    assert(i < rel_hyp.size());
+    const string& hyp_rel = rel_hyp[i];
+    out << index << '\t'        // 1. ID 
+        << wit << '\t'         // 2. FORM
+        << "_" << '\t'         // 3. LEMMA 
+        << "_" << '\t'         // 4. CPOSTAG 
+        << pit << '\t'         // 5. POSTAG
+        << "_" << '\t'         // 6. FEATS
+        << hyp_head << '\t'    // 7. HEAD
+        << hyp_rel << '\t'     // 8. DEPREL
+        << "_" << '\t'         // 9. PHEAD
+        << "_" << endl;        // 10. PDEPREL
+  }
+  out << endl;
+}
+
+// runs f(0), ..., f(n - 1) at once, f(0) on the calling thread
+template <class F>
+void run_threads(unsigned n, F f) {
+  vector<thread> workers;
+  for (unsigned t = 1; t < n; ++t) workers.emplace_back(f, t);
+  f(0);
+  for (auto& w : workers) w.join();
+}
+
+// parses every CoNLL sentence read from in, writing each parse to out as
+// soon as it is available
+void parse_conll(ParserBuilder& parser, const set<unsigned>& training_vocab, unsigned kUNK,
+                 istream& in, ostream& out) {
+  Decoder decoder(parser);
+  vector<unsigned> sentence, sentencePos;
+  vector<string> sentenceUnkStr, sentencePosUnkStr;
+  while (corpus.read_conll_sentence(in, &sentence, &sentencePos, &sentenceUnkStr, &sentencePosUnkStr)) {
+    vector<unsigned> tsentence=sentence;
+    for (auto& w : tsentence)
+      if (training_vocab.count(w) == 0) w = kUNK;
+    // POS tags unknown to the model are already 0, which has no embedding
+    vector<unsigned> pred = (BEAM_SIZE > 1 ? decoder.parse_beam(sentence,tsentence,sentencePos,BEAM_SIZE)
+                             : decoder.parse(sentence,tsentence,sentencePos));
+    vector<string> rel_hyp;
+    vector<int> hyp = parser.compute_heads(sentence.size(), pred, &rel_hyp);
+    output_conll(out, sentence, sentencePos, sentenceUnkStr, corpus.intToWords, corpus.intToPos, hyp, rel_hyp,
+                 &sentencePosUnkStr);
+    out.flush();
+  }
+}
+
+// accepts connections on a Unix domain socket, one at a time. a client
+// sends CoNLL sentences separated by blank lines and gets each parse back
+// as soon as the blank line ending its sentence has been received.
+void serve_socket(ParserBuilder& parser, const set<unsigned>& training_vocab, unsigned kUNK,
+                  const string& path) {
+  int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server_fd < 0) { perror("socket"); abort(); }
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    cerr << "Socket path too long: " << path << endl;
+    abort();
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  if (::bind(server_fd, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); abort(); }
+  if (listen(server_fd, 16) < 0) { perror("listen"); abort(); }
+  cerr << "Listening on " << path << endl;
+  char buf[65536];
+  while (true) {
+    int fd = accept(server_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      break;
+    }
+    string pending;
+    bool ok = true;
+    while (ok) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR) continue;
+      const bool eof = (n <= 0);
+      if (!eof) pending.append(buf, n);
+      // everything up to the last blank line holds complete sentences
+      size_t end = pending.size();
+      if (!eof) {
+        const size_t lf = pending.rfind("\n\n"), crlf = pending.rfind("\n\r\n");
+        if (lf == string::npos && crlf == string::npos) continue;
+        end = max(lf == string::npos ? 0 : lf + 2, crlf == string::npos ? 0 : crlf + 3);
+      }
+      istringstream in(pending.substr(0, end));
+      pending.erase(0, end);
+      ostringstream out;
+      parse_conll(parser, training_vocab, kUNK, in, out);
+      const string reply = out.str();
+      for (size_t done = 0; done < reply.size(); ) {
+        ssize_t m = send(fd, reply.data() + done, reply.size() - done, MSG_NOSIGNAL);
+        if (m < 0 && errno == EINTR) continue;
+        if (m <= 0) { ok = false; break; }
+        done += m;
+      }
+      if (eof) break;
+    }
+    close(fd);
+  }
+  close(server_fd);
+  unlink(path.c_str());
 }
 
 
@@ -492,6 +1239,7 @@ int main(int argc, char** argv) {
   po::variables_map conf;
   InitCommandLine(argc, argv, &conf);
   USE_POS = conf.count("use_pos_tags");
+  BEAM_SIZE = max(1u, conf["beam_size"].as<unsigned>());
 
   LAYERS = conf["layers"].as<unsigned>();
   INPUT_DIM = conf["input_dim"].as<unsigned>();
@@ -524,30 +1272,42 @@ int main(int argc, char** argv) {
   const string fname = os.str();
   cerr << "Writing parameters to file: " << fname << endl;
   bool softlinkCreated = false;
-  corpus.load_correct_actions(conf["training_data"].as<string>());	
+  set<unsigned> training_vocab; // words available in the training corpus
+  set<unsigned> singletons;
+  const bool use_vocab_file = conf.count("vocab") && !conf.count("train");
+  if (use_vocab_file) {
+    corpus.load_vocabulary(conf["vocab"].as<string>(), &training_vocab, &pretrained_vocab);
+    if (conf.count("words"))
+      cerr << "Ignoring --words: the pretrained vectors are part of the model\n";
+  } else {
+    corpus.load_correct_actions(conf["training_data"].as<string>());	
+  }
   const unsigned kUNK = corpus.get_or_add_word(cpyp::Corpus::UNK);
   kROOT_SYMBOL = corpus.get_or_add_word(ROOT_SYMBOL);
 
-  if (conf.count("words")) {
-    pretrained[kUNK] = vector<float>(PRETRAINED_DIM, 0);
+  unique_ptr<cpyp::PretrainedVectors> pretrained;
+  if (conf.count("words") && !use_vocab_file) {
     cerr << "Loading from " << conf["words"].as<string>() << " with" << PRETRAINED_DIM << " dimensions\n";
-    ifstream in(conf["words"].as<string>().c_str());
-    string line;
-    getline(in, line);
-    vector<float> v(PRETRAINED_DIM, 0);
-    string word;
-    while (getline(in, line)) {
-      istringstream lin(line);
-      lin >> word;
-      for (unsigned i = 0; i < PRETRAINED_DIM; ++i) lin >> v[i];
-      unsigned id = corpus.get_or_add_word(word);
-      pretrained[id] = v;
+    pretrained.reset(new cpyp::PretrainedVectors(conf["words"].as<string>(), PRETRAINED_DIM,
+                                                 thread::hardware_concurrency()));
+    unordered_set<string> input_words;
+    const bool prune = conf.count("prune_pretrained");
+    if (prune) {  // words without an id by now are not in the training data
+      for (const char* data : {"dev_data", "test_data"})
+        if (conf.count(data)) corpus.read_oracle_words(conf[data].as<string>(), &input_words);
     }
+    pretrained->assign_ids([&](const string& word) {
+      if (prune && !corpus.wordsToInt.count(word) && !input_words.count(word))
+        return unsigned(cpyp::PretrainedVectors::kSkip);
+      return corpus.get_or_add_word(word);
+    });
+    pretrained_vocab.resize(corpus.nwords + 1);
+    pretrained_vocab[kUNK] = true;
+    for (unsigned id : pretrained->ids())
+      if (id != cpyp::PretrainedVectors::kSkip) pretrained_vocab[id] = true;
   }
 
-  set<unsigned> training_vocab; // words available in the training corpus
-  set<unsigned> singletons;
-  {  // compute the singletons in the parser's training data
+  if (!use_vocab_file) {  // compute the singletons in the parser's training data
     map<unsigned, unsigned> counts;
     for (auto sent : corpus.sentences)
       for (auto word : sent.second) { training_vocab.insert(word); counts[word]++; }
@@ -557,18 +1317,65 @@ int main(int argc, char** argv) {
 
   cerr << "Number of words: " << corpus.nwords << endl;
   VOCAB_SIZE = corpus.nwords + 1;
+  pretrained_vocab.resize(VOCAB_SIZE);
   ACTION_SIZE = corpus.nactions + 1;
   POS_SIZE = corpus.npos + 10;  // bad way of dealing with the fact that we may see new POS tags in the test set
   possible_actions.resize(corpus.nactions);
   for (unsigned i = 0; i < corpus.nactions; ++i)
     possible_actions[i] = i;
+  action_table.compile(corpus.actions);
+  if (conf.count("train")) {
+    const string vocab_fname = fname.substr(0, fname.rfind('.')) + ".vocab";
+    corpus.save_vocabulary(vocab_fname, training_vocab, pretrained_vocab);
+    cerr << "Wrote vocabulary to file: " << vocab_fname << endl;
+  }
 
   Model model;
-  ParserBuilder parser(&model, pretrained);
+  // a mapped model replaces every table, so they are not allocated (nor
+  // filled with random values and pretrained vectors) beforehand
+  const bool mmap_model = conf.count("model") && conf.count("mmap_model");
+  if (mmap_model) model.defer_storage();
+  ParserBuilder parser(&model);
+  if (pretrained && !mmap_model) {  // the vectors are parsed straight into the lookup table
+    parser.p_t->Initialize(kUNK, vector<float>(PRETRAINED_DIM, 0));
+    pretrained->fill([&](unsigned id) { return parser.p_t->values[id].v; });
+  }
+  pretrained.reset();
   if (conf.count("model")) {
-    ifstream in(conf["model"].as<string>().c_str());
-    boost::archive::text_iarchive ia(in);
-    ia >> model;
+    const string model_file = conf["model"].as<string>();
+    if (mmap_model) {
+      if (conf.count("train")) {
+        cerr << "--mmap_model maps the parameters read-only and cannot be used for training\n";
+        return 1;
+      }
+      load_cnn_model_mmap(model_file, &model);
+    } else if (is_binary_cnn_model(model_file)) {
+      load_cnn_model_binary(model_file, &model);
+    } else {  // boost text archive written by older versions
+      ifstream in(model_file.c_str());
+      boost::archive::text_iarchive ia(in);
+      ia >> model;
+    }
+  }
+  if (conf.count("convert_model")) {
+    if (!conf.count("model")) {
+      cerr << "--convert_model requires --model\n";
+      return 1;
+    }
+    save_cnn_model_binary(conf["convert_model"].as<string>(), model);
+    cerr << "Wrote binary model to " << conf["convert_model"].as<string>() << endl;
+    return 0;
+  }
+
+  if (conf.count("server") || conf.count("socket")) {
+    if (!conf.count("model"))
+      cerr << "Warning: no --model given, parsing with untrained parameters\n";
+    if (conf.count("socket")) {
+      serve_socket(parser, training_vocab, kUNK, conf["socket"].as<string>());
+    } else {
+      parse_conll(parser, training_vocab, kUNK, cin, cout);
+    }
+    return 0;
   }
 
   // OOV words will be replaced by UNK tokens
@@ -580,6 +1387,8 @@ int main(int argc, char** argv) {
     //MomentumSGDTrainer sgd(&model);
     sgd.eta_decay = 0.08;
     //sgd.eta_decay = 0.05;
+    // the pretrained vectors are fixed
+    if (parser.p_t) sgd.exempt_from_regularization(parser.p_t);
     vector<unsigned> order(corpus.nsentences);
     for (unsigned i = 0; i < corpus.nsentences; ++i)
       order[i] = i;
@@ -592,10 +1401,33 @@ int main(int argc, char** argv) {
     double llh = 0;
     bool first = true;
     int iter = -1;
+    // with --threads, the extra threads train copies of the parser (the
+    // builders hold per-graph state) on the shared parameters
+    const unsigned threads = max(1u, conf["threads"].as<unsigned>());
+    unsigned batch_size = max(1u, conf["batch_size"].as<unsigned>());
+    if (conf.count("sync_updates") && batch_size == 1) batch_size = threads;
+    vector<ParserBuilder> worker_parsers(threads - 1, parser);
+    // the updates of a batch are split over the same threads
+    if (batch_size > 1) sgd.set_threads(threads);
+    vector<LocalGradients> local_grads;
+    if (threads > 1)
+      for (unsigned t = 0; t < threads; ++t) local_grads.emplace_back(model);
+    vector<double> rights(threads, 0);
+    // each thread parses all its sentences in one graph, which keeps the
+    // parameters of its parser and drops the nodes of the last sentence
+    vector<ComputationGraph> graphs(threads);
+    for (unsigned t = 0; t < threads; ++t) {
+      (t ? worker_parsers[t - 1] : parser).new_graph(graphs[t]);
+      graphs[t].checkpoint();
+    }
     time_t time_start = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
     cerr << "TRAINING STARTED AT: " << put_time(localtime(&time_start), "%c %Z") << endl;
     while(!requested_stop) {
       ++iter;
+      // the sentences of this round and their UNK replacements are drawn
+      // first, so that only this thread uses the random number generator
+      vector<unsigned> round;
+      vector<vector<unsigned>> tsentences;
       for (unsigned sii = 0; sii < status_every_i_iterations; ++sii) {
            if (si == corpus.nsentences) {
              si = 0;
@@ -604,26 +1436,99 @@ int main(int argc, char** argv) {
              random_shuffle(order.begin(), order.end());
            }
            tot_seen += 1;
-           const vector<unsigned>& sentence=corpus.sentences[order[si]];
-           vector<unsigned> tsentence=sentence;
+           vector<unsigned> tsentence=corpus.sentences[order[si]];
            if (unk_strategy == 1) {
              for (auto& w : tsentence)
                if (singletons.count(w) && cnn::rand01() < unk_prob) w = kUNK;
            }
-	   const vector<unsigned>& sentencePos=corpus.sentencesPos[order[si]]; 
-	   const vector<unsigned>& actions=corpus.correct_act_sent[order[si]];
-           ComputationGraph hg;
-           parser.log_prob_parser(&hg,sentence,tsentence,sentencePos,actions,corpus.actions,corpus.intToWords,&right);
-           double lp = as_scalar(hg.incremental_forward());
+           round.push_back(order[si]);
+           tsentences.push_back(tsentence);
+           ++si;
+      }
+      // builds the graph of the kth sentence of the round, returning its loss
+      auto train_graph = [&](ParserBuilder& p, unsigned k, ComputationGraph* hg, double* right) {
+           hg->revert();
+           const vector<unsigned>& sentence=corpus.sentences[round[k]];
+	   const vector<unsigned>& sentencePos=corpus.sentencesPos[round[k]]; 
+	   const vector<unsigned>& actions=corpus.correct_act_sent[round[k]];
+           p.log_prob_parser(hg,sentence,tsentences[k],sentencePos,actions,corpus.intToWords,right);
+           double lp = as_scalar(hg->incremental_forward());
            if (lp < 0) {
-             cerr << "Log prob < 0 on sentence " << order[si] << ": lp=" << lp << endl;
+             cerr << "Log prob < 0 on sentence " << round[k] << ": lp=" << lp << endl;
              assert(lp >= 0.0);
            }
+           return lp;
+      };
+      if (threads == 1 && batch_size == 1) {
+        for (unsigned k = 0; k < round.size(); ++k) {
+           ComputationGraph& hg = graphs[0];
+           double lp = train_graph(parser, k, &hg, &right);
            hg.backward();
            sgd.update(1.0);
            llh += lp;
-           ++si;
-           trs += actions.size();
+           trs += corpus.correct_act_sent[round[k]].size();
+        }
+      } else if (batch_size > 1) {
+        // the gradients of batch_size sentences are summed (thread t
+        // computing those of sentences t, t + threads, ...) and applied in
+        // a single clipped update
+        for (unsigned k0 = 0; k0 < round.size(); k0 += batch_size) {
+          const unsigned n = min<unsigned>(batch_size, round.size() - k0);
+          if (threads == 1) {
+            for (unsigned k = k0; k < k0 + n; ++k) {
+              ComputationGraph& hg = graphs[0];
+              llh += train_graph(parser, k, &hg, &right);
+              hg.backward();
+            }
+          } else {
+            const unsigned m = min(threads, n);
+            vector<double> llhs(m, 0);
+            run_threads(m, [&](unsigned t) {
+              local_grads[t].clear();
+              for (unsigned k = k0 + t; k < k0 + n; k += m) {
+                ComputationGraph& hg = graphs[t];
+                llhs[t] += train_graph(t ? worker_parsers[t - 1] : parser, k, &hg, &rights[t]);
+                hg.compute_gradients();
+                local_grads[t].add(hg);
+              }
+            });
+            for (unsigned t = 0; t < m; ++t) {
+              local_grads[t].accumulate_into_model(1.0);
+              llh += llhs[t];
+            }
+          }
+          for (unsigned k = k0; k < k0 + n; ++k)
+            trs += corpus.correct_act_sent[round[k]].size();
+          sgd.update(1.0 / n);
+        }
+      } else {
+        // Hogwild: the threads take sentences in turn and update the shared
+        // parameters without locking
+        atomic<unsigned> next_sentence(0);
+        vector<double> llhs(threads, 0);
+        vector<unsigned> trss(threads, 0), clips(threads, 0);
+        run_threads(threads, [&](unsigned t) {
+          unsigned k;
+          while ((k = next_sentence++) < round.size()) {
+            ComputationGraph& hg = graphs[t];
+            llhs[t] += train_graph(t ? worker_parsers[t - 1] : parser, k, &hg, &rights[t]);
+            hg.compute_gradients();
+            local_grads[t].clear();
+            local_grads[t].add(hg);
+            clips[t] += sgd.hogwild_update(local_grads[t]);
+            trss[t] += corpus.correct_act_sent[round[k]].size();
+          }
+        });
+        for (unsigned t = 0; t < threads; ++t) {
+          llh += llhs[t];
+          trs += trss[t];
+          sgd.clips += clips[t];
+        }
+        sgd.updates += round.size();
+      }
+      for (auto& r : rights) {
+        right += r;
+        r = 0;
       }
       sgd.status();
       time_t time_now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
@@ -633,6 +1538,9 @@ int main(int argc, char** argv) {
       static int logc = 0;
       ++logc;
       if (logc % 25 == 1) { // report on dev set
+        // the dev parses and the saved model should see the decay that the
+        // embeddings not used lately still owe
+        sgd.flush_regularization();
         unsigned dev_size = corpus.nsentencesDev;
         // dev_size = 100;
         double llh = 0;
@@ -641,6 +1549,7 @@ int main(int argc, char** argv) {
         double correct_heads = 0;
         double total_heads = 0;
         auto t_start = std::chrono::high_resolution_clock::now();
+        Decoder decoder(parser);
         for (unsigned sii = 0; sii < dev_size; ++sii) {
            const vector<unsigned>& sentence=corpus.sentencesDev[sii];
 	   const vector<unsigned>& sentencePos=corpus.sentencesPosDev[sii]; 
@@ -649,13 +1558,12 @@ int main(int argc, char** argv) {
            for (auto& w : tsentence)
              if (training_vocab.count(w) == 0) w = kUNK;
 
-           ComputationGraph hg;
-	   vector<unsigned> pred = parser.log_prob_parser(&hg,sentence,tsentence,sentencePos,vector<unsigned>(),corpus.actions,corpus.intToWords,&right);
+	   vector<unsigned> pred = decoder.parse(sentence,tsentence,sentencePos);
 	   double lp = 0;
            llh -= lp;
            trs += actions.size();
-           map<int,int> ref = parser.compute_heads(sentence.size(), actions, corpus.actions);
-           map<int,int> hyp = parser.compute_heads(sentence.size(), pred, corpus.actions);
+           vector<int> ref = parser.compute_heads(sentence.size(), actions);
+           vector<int> hyp = parser.compute_heads(sentence.size(), pred);
            //output_conll(sentence, corpus.intToWords, ref, hyp);
            correct_heads += compute_correct(ref, hyp, sentence.size() - 1);
            total_heads += sentence.size() - 1;
@@ -664,9 +1572,7 @@ int main(int argc, char** argv) {
         cerr << "  **dev (iter=" << iter << " epoch=" << (tot_seen / corpus.nsentences) << ")\tllh=" << llh << " ppl: " << exp(llh / trs) << " err: " << (trs - right) / trs << " uas: " << (correct_heads / total_heads) << "\t[" << dev_size << " sents in " << std::chrono::duration<double, std::milli>(t_end-t_start).count() << " ms]" << endl;
         if (correct_heads > best_correct_heads) {
           best_correct_heads = correct_heads;
-          ofstream out(fname);
-          boost::archive::text_oarchive oa(out);
-          oa << model;
+          save_cnn_model_binary(fname, model);
           // Create a soft link to the most recent model in order to make it
           // easier to refer to it in a shell script.
           if (!softlinkCreated) {
@@ -690,24 +1596,64 @@ int main(int argc, char** argv) {
     double total_heads = 0;
     auto t_start = std::chrono::high_resolution_clock::now();
     unsigned corpus_size = corpus.nsentencesDev;
+    const unsigned decode_batch_size = max(1u, conf["decode_batch_size"].as<unsigned>());
+    const unsigned threads = max(1u, conf["threads"].as<unsigned>());
+    // the threads take blocks of decode_batch_size sentences in turn; the
+    // parses are written out in input order once all have been decoded
+    vector<vector<unsigned>> preds(corpus_size);
+    atomic<unsigned> next_block(0);
+    auto decode = [&](ParserBuilder& p) {
+      Decoder decoder(p);
+      // the batched decoder reuses the parameters of its graph
+      ComputationGraph cg;
+      if (BEAM_SIZE == 1 && decode_batch_size > 1) {
+        p.new_graph(cg);
+        cg.checkpoint();
+      }
+      unsigned sii;
+      while ((sii = next_block.fetch_add(decode_batch_size)) < corpus_size) {
+        const unsigned n = min(decode_batch_size, corpus_size - sii);
+        vector<vector<unsigned>> raw(n), sents(n), poss(n);
+        for (unsigned j = 0; j < n; ++j) {
+          raw[j] = corpus.sentencesDev[sii + j];
+          poss[j] = corpus.sentencesPosDev[sii + j];
+          sents[j] = raw[j];
+          for (auto& w : sents[j])
+            if (training_vocab.count(w) == 0) w = kUNK;
+        }
+        if (BEAM_SIZE > 1) {
+          for (unsigned j = 0; j < n; ++j)
+            preds[sii + j] = decoder.parse_beam(raw[j],sents[j],poss[j],BEAM_SIZE);
+        } else if (decode_batch_size > 1) {
+          cg.revert();
+          vector<vector<unsigned>> batch_pred = p.log_prob_parser_batch(&cg,raw,sents,poss);
+          for (unsigned j = 0; j < n; ++j) preds[sii + j].swap(batch_pred[j]);
+        } else {
+          preds[sii] = decoder.parse(raw[0],sents[0],poss[0]);
+        }
+      }
+    };
+    run_threads(threads, [&](unsigned t) {
+      if (t == 0) {
+        decode(parser);
+      } else {
+        ParserBuilder worker_parser(parser);  // the builders hold per-graph state
+        decode(worker_parser);
+      }
+    });
     for (unsigned sii = 0; sii < corpus_size; ++sii) {
       const vector<unsigned>& sentence=corpus.sentencesDev[sii];
       const vector<unsigned>& sentencePos=corpus.sentencesPosDev[sii]; 
       const vector<string>& sentenceUnkStr=corpus.sentencesStrDev[sii]; 
       const vector<unsigned>& actions=corpus.correct_act_sentDev[sii];
-      vector<unsigned> tsentence=sentence;
-      for (auto& w : tsentence)
-        if (training_vocab.count(w) == 0) w = kUNK;
-      ComputationGraph cg;
+      const vector<unsigned>& pred=preds[sii];
       double lp = 0;
-      vector<unsigned> pred;
-      pred = parser.log_prob_parser(&cg,sentence,tsentence,sentencePos,vector<unsigned>(),corpus.actions,corpus.intToWords,&right);
       llh -= lp;
       trs += actions.size();
-      map<int, string> rel_ref, rel_hyp;
-      map<int,int> ref = parser.compute_heads(sentence.size(), actions, corpus.actions, &rel_ref);
-      map<int,int> hyp = parser.compute_heads(sentence.size(), pred, corpus.actions, &rel_hyp);
-      output_conll(sentence, sentencePos, sentenceUnkStr, corpus.intToWords, corpus.intToPos, hyp, rel_hyp);
+      vector<string> rel_ref, rel_hyp;
+      vector<int> ref = parser.compute_heads(sentence.size(), actions, &rel_ref);
+      vector<int> hyp = parser.compute_heads(sentence.size(), pred, &rel_hyp);
+      output_conll(cout, sentence, sentencePos, sentenceUnkStr, corpus.intToWords, corpus.intToPos, hyp, rel_hyp);
       correct_heads += compute_correct(ref, hyp, sentence.size() - 1);
       total_heads += sentence.size() - 1;
     }
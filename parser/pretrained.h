@@ -0,0 +1,267 @@
+#ifndef PRETRAINED_H_
+#define PRETRAINED_H_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <iostream>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cpyp {
+
+// reads pretrained word vectors, either in the word2vec text format (an
+// optional "<count> <dim>" header line, then "word v_1 ... v_dim" on each
+// line) or, for files whose name ends in .bin, in the word2vec binary
+// format. the file is mapped into memory and read in three passes:
+//  1. the constructor finds the entries, over chunks of the file in parallel
+//  2. assign_ids maps each word to an id, serially and in file order, so
+//     that the vocabulary and the lookup table can be sized
+//  3. fill parses the vectors in parallel, straight into their rows
+class PretrainedVectors {
+ public:
+  enum : unsigned { kSkip = ~0u };
+
+  PretrainedVectors(const std::string& file, unsigned dim, unsigned threads)
+      : dim(dim), threads(threads ? threads : 1), data(nullptr), size(0) {
+    int fd = open(file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      std::cerr << "could not open " << file << std::endl;
+      abort();
+    }
+    size = st.st_size;
+    if (size > 0) {
+      void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        std::cerr << "could not map " << file << std::endl;
+        abort();
+      }
+      data = static_cast<const char*>(addr);
+      madvise(addr, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    binary = file.size() > 4 && file.compare(file.size() - 4, 4, ".bin") == 0;
+    if (binary) find_binary_entries(); else find_text_entries();
+  }
+
+  ~PretrainedVectors() {
+    if (data) munmap(const_cast<char*>(data), size);
+  }
+
+  unsigned entries() const { return words.size(); }
+
+  // calls get_id(word) for every entry, in file order; returning kSkip
+  // drops the entry. if a word occurs more than once, its last vector is
+  // the one that is kept, as when the table was filled line by line.
+  void assign_ids(const std::function<unsigned(const std::string&)>& get_id) {
+    entry_ids.resize(words.size());
+    std::vector<unsigned> last;  // id -> entry
+    for (unsigned i = 0; i < words.size(); ++i) {
+      const unsigned id = get_id(std::string(data + words[i].first, words[i].second));
+      entry_ids[i] = id;
+      if (id == kSkip) continue;
+      if (id >= last.size()) last.resize(id + 1, kSkip);
+      if (last[id] != kSkip) entry_ids[last[id]] = kSkip;
+      last[id] = i;
+    }
+  }
+
+  // id of every entry (kSkip for dropped ones), set by assign_ids
+  const std::vector<unsigned>& ids() const { return entry_ids; }
+
+  // writes the vector of every entry kept by assign_ids to row(id), which
+  // must point to dim floats and may be called from several threads
+  void fill(const std::function<float*(unsigned)>& row) const {
+    assert(entry_ids.size() == words.size());
+    const unsigned n = words.size();
+    auto work = [&](unsigned begin, unsigned end) {
+      for (unsigned i = begin; i < end; ++i) {
+        if (entry_ids[i] == kSkip) continue;
+        float* r = row(entry_ids[i]);
+        if (binary)
+          memcpy(r, data + vectors[i], dim * sizeof(float));
+        else
+          parse_vector(data + vectors[i], data + size, r);
+      }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t)
+      pool.emplace_back(work, uint64_t(n) * t / threads, uint64_t(n) * (t + 1) / threads);
+    work(0, n / threads);
+    for (auto& th : pool) th.join();
+  }
+
+ private:
+  static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+  // the text header is a line with exactly two fields
+  size_t skip_text_header() const {
+    const char* end = static_cast<const char*>(memchr(data, '\n', size));
+    if (!end) end = data + size;
+    unsigned fields = 0;
+    for (const char* p = data; p < end; ) {
+      while (p < end && is_space(*p)) ++p;
+      if (p == end) break;
+      ++fields;
+      while (p < end && !is_space(*p)) ++p;
+    }
+    if (fields == 2 && dim != 1) return end < data + size ? end - data + 1 : size;
+    return 0;
+  }
+
+  void find_text_entries() {
+    if (!size) return;
+    const size_t start = skip_text_header();
+    // each chunk owns the lines that start inside it
+    std::vector<size_t> bounds(threads + 1, size);
+    bounds[0] = start;
+    for (unsigned t = 1; t < threads; ++t) {
+      size_t b = start + (size - start) * t / threads;
+      if (b > start) {
+        const char* nl = static_cast<const char*>(memchr(data + b - 1, '\n', size - b + 1));
+        b = nl ? nl - data + 1 : size;
+      }
+      bounds[t] = std::max(b, bounds[t - 1]);
+    }
+    std::vector<std::vector<std::pair<size_t, size_t>>> chunk_words(threads);
+    std::vector<std::vector<size_t>> chunk_vectors(threads);
+    auto work = [&](unsigned t) {
+      const char* end = data + size;
+      for (const char* p = data + bounds[t]; p < data + bounds[t + 1]; ) {
+        const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+        const char* eol = nl ? nl : end;
+        const char* w = p;
+        while (w < eol && is_space(*w)) ++w;
+        const char* we = w;
+        while (we < eol && !is_space(*we)) ++we;
+        if (we > w) {
+          chunk_words[t].push_back(std::make_pair(size_t(w - data), size_t(we - w)));
+          chunk_vectors[t].push_back(we - data);
+        }
+        p = eol + 1;
+      }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(work, t);
+    work(0);
+    for (auto& th : pool) th.join();
+    for (unsigned t = 0; t < threads; ++t) {
+      words.insert(words.end(), chunk_words[t].begin(), chunk_words[t].end());
+      vectors.insert(vectors.end(), chunk_vectors[t].begin(), chunk_vectors[t].end());
+    }
+  }
+
+  // "<count> <dim>\n", then for each word: the word, a space, and dim raw
+  // little-endian floats, optionally followed by a newline
+  void find_binary_entries() {
+    const char* p = data;
+    const char* end = data + size;
+    const char* nl = static_cast<const char*>(memchr(p, '\n', size));
+    const std::string header(p, nl ? nl - p : size);
+    unsigned long count = 0, file_dim = 0;
+    if (sscanf(header.c_str(), "%lu %lu", &count, &file_dim) != 2 || file_dim != dim) {
+      std::cerr << "binary vectors have dimension " << file_dim << ", expected " << dim << std::endl;
+      abort();
+    }
+    p = nl ? nl + 1 : end;
+    words.reserve(count);
+    vectors.reserve(count);
+    while (p < end) {
+      while (p < end && (*p == '\n' || is_space(*p))) ++p;
+      if (p == end) break;
+      const char* w = p;
+      while (p < end && *p != ' ') ++p;
+      if (end - p < 1 + ptrdiff_t(dim * sizeof(float))) {
+        std::cerr << "truncated binary vectors" << std::endl;
+        abort();
+      }
+      words.push_back(std::make_pair(size_t(w - data), size_t(p - w)));
+      vectors.push_back(p + 1 - data);
+      p += 1 + dim * sizeof(float);
+    }
+  }
+
+  // parses up to dim floats from the line at p; missing values are zero
+  void parse_vector(const char* p, const char* end, float* out) const {
+    unsigned i = 0;
+    while (i < dim) {
+      while (p < end && is_space(*p)) ++p;
+      if (p == end || *p == '\n') break;
+      p = parse_float(p, end, &out[i++]);
+    }
+    for (; i < dim; ++i) out[i] = 0;
+  }
+
+  // [+-]digits[.digits][(e|E)[+-]digits] whose digits form an integer below
+  // 2^24, scaled by at most 10^10, is converted with a single float
+  // multiplication or division of two exact floats, which rounds once and
+  // so gives the same bits as strtof; anything else goes to strtof
+  static const char* parse_float(const char* p, const char* end, float* out) {
+    static const float kPow10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    const char* start = p;
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+    uint64_t mant = 0;
+    int digits = 0, exp10 = 0;
+    bool any = false;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+      if (mant || *p != '0') ++digits;
+      mant = mant * 10 + (*p - '0');
+    }
+    if (p < end && *p == '.') {
+      for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+        if (mant || *p != '0') ++digits;
+        mant = mant * 10 + (*p - '0');
+        --exp10;
+      }
+    }
+    if (any && p < end && (*p == 'e' || *p == 'E')) {
+      const char* q = p + 1;
+      bool eneg = false;
+      if (q < end && (*q == '-' || *q == '+')) eneg = (*q++ == '-');
+      int e = 0;
+      bool edigits = false;
+      for (; q < end && *q >= '0' && *q <= '9'; ++q, edigits = true)
+        if (e < 10000) e = e * 10 + (*q - '0');
+      if (edigits) {
+        exp10 += eneg ? -e : e;
+        p = q;
+      }
+    }
+    if (any && digits <= 15 && mant < (1u << 24) && exp10 >= -10 && exp10 <= 10 &&
+        (p == end || is_space(*p) || *p == '\n')) {
+      const float m = mant;
+      const float v = exp10 < 0 ? m / kPow10[-exp10] : m * kPow10[exp10];
+      *out = neg ? -v : v;
+      return p;
+    }
+    p = start;
+    while (p < end && !is_space(*p) && *p != '\n') ++p;
+    *out = strtof(std::string(start, p).c_str(), nullptr);
+    return p;
+  }
+
+  const unsigned dim;
+  const unsigned threads;
+  const char* data;
+  size_t size;
+  bool binary;
+  std::vector<std::pair<size_t, size_t>> words;  // offset and length of each word
+  std::vector<size_t> vectors;  // offset of each vector
+  std::vector<unsigned> entry_ids;
+};
+
+} // namespace cpyp
+
+#endif